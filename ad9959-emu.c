@@ -0,0 +1,402 @@
+/*
+ * ad9959 + stm32 board emulator, for testing and benchmarking freqgen
+ * without the hardware.
+ *
+ * Opens a pseudo-terminal, prints the path to give freqgen's -p and then
+ * answers the same AT commands the board does: sets get OK, queries get
+ * +KEY=value and out of range values get ERROR_DATA_OVER_RANGEM. Replies
+ * can be delayed (-l/-j) and errors or lost replies injected (-e/-x), or
+ * lost when too many are outstanding, like a small input buffer (-b).
+ *
+ * Build as such:
+ *	cc -ggdb -Wall -pedantic -o ad9959-emu ad9959-emu.c
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <termios.h>
+#include <time.h>
+
+#define	MAX_CHAN	4
+#define	LINE_SIZE	128
+#define	REPLY_QUEUE	1024		// replies waiting for their latency to pass (power of 2)
+
+struct reply {
+    int64_t due;			// usec
+    char text[LINE_SIZE];
+};
+
+struct reply replies[REPLY_QUEUE];
+unsigned reply_head, reply_tail;
+
+// board state, the same fields the real one reports
+struct chan {
+    char mode[8];
+    long fre, pha, amp, startfre, endfre, startamp, endamp, step, time;
+    char sweep[4];
+} chans[MAX_CHAN];
+long ref = 25000000, mult = 20, channel = 1;
+
+// options
+long latency = 0;		// usec before each reply
+long jitter = 0;		// +/- usec on top
+double error_rate = 0;		// fraction of commands answered ERROR
+double drop_rate = 0;		// fraction of commands never answered
+unsigned buffer = 0;		// commands arriving while this many replies are waiting are lost (0 = never)
+int verbose = 0;
+
+unsigned long commands, errors, dropped;
+volatile sig_atomic_t done = 0;
+
+int64_t mono_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+    done = 1;
+}
+
+void queue_reply(const char *text) {
+    int64_t due = mono_usec() + latency;
+
+    if (jitter > 0) {
+       due += (random() % (2 * jitter + 1)) - jitter;
+    }
+    // replies go out in order, whatever the jitter says
+    if (reply_head != reply_tail) {
+       int64_t last = replies[(reply_head - 1) & (REPLY_QUEUE - 1)].due;
+       if (due < last) {
+          due = last;
+       }
+    }
+    if (reply_head - reply_tail >= REPLY_QUEUE) {
+       fprintf(stderr, "emu: reply queue full, dropping %s\n", text);
+       return;
+    }
+    struct reply *r = &replies[reply_head++ & (REPLY_QUEUE - 1)];
+    r->due = due;
+    snprintf(r->text, sizeof(r->text), "%s\r\n", text);
+}
+
+static int chance(double rate) {
+    return (rate > 0 && random() < rate * RAND_MAX);
+}
+
+// A numeric field: what it's called, where it lives and what the board accepts
+struct key {
+    const char *name;
+    long *(*where)(const char *name);
+    long min, max;
+};
+
+static long *chan_field(const char *name) {
+    struct chan *c = &chans[channel - 1];
+
+    if (strcmp(name, "FRE") == 0) return &c->fre;
+    if (strcmp(name, "PHA") == 0) return &c->pha;
+    if (strcmp(name, "AMP") == 0) return &c->amp;
+    if (strcmp(name, "STARTFRE") == 0) return &c->startfre;
+    if (strcmp(name, "ENDFRE") == 0) return &c->endfre;
+    if (strcmp(name, "STARTAMP") == 0) return &c->startamp;
+    if (strcmp(name, "ENDAMP") == 0) return &c->endamp;
+    if (strcmp(name, "STEP") == 0) return &c->step;
+    if (strcmp(name, "TIME") == 0) return &c->time;
+    return NULL;
+}
+
+static long *board_field(const char *name) {
+    if (strcmp(name, "REF") == 0) return &ref;
+    if (strcmp(name, "MULT") == 0) return &mult;
+    if (strcmp(name, "CHANNEL") == 0) return &channel;
+    return NULL;
+}
+
+struct key keys[] = {
+    { "FRE",      chan_field,  1, 200000000 },
+    { "PHA",      chan_field,  0, 16383 },
+    { "AMP",      chan_field,  0, 1023 },
+    { "STARTFRE", chan_field,  1, 200000000 },
+    { "ENDFRE",   chan_field,  1, 200000000 },
+    { "STARTAMP", chan_field,  0, 1023 },
+    { "ENDAMP",   chan_field,  0, 1023 },
+    { "STEP",     chan_field,  1, 200000000 },
+    { "TIME",     chan_field,  1, 9999 },
+    { "REF",      board_field, 10000000, 125000000 },
+    { "MULT",     board_field, 1, 20 },
+    { "CHANNEL",  board_field, 1, MAX_CHAN },
+    { NULL,       NULL,        0, 0 }
+};
+
+void handle_line(const char *line) {
+    char key[16], reply[LINE_SIZE];
+    const char *value;
+    size_t klen;
+
+    if (verbose) {
+       printf("emu: <- %s\n", line);
+    }
+    if (strncmp(line, "AT+", 3) != 0) {
+       queue_reply("ERROR");
+       return;
+    }
+    commands++;
+
+    line += 3;
+    klen = strcspn(line, "+");
+    if (klen >= sizeof(key)) {
+       queue_reply("ERROR");
+       return;
+    }
+    memcpy(key, line, klen);
+    key[klen] = '\0';
+    value = (line[klen] == '+' ? line + klen + 1 : NULL);
+
+    // these just happen, no answer
+    if (strcmp(key, "RESET") == 0 || strcmp(key, "RESTORE") == 0) {
+       return;
+    }
+
+    if (buffer > 0 && reply_head - reply_tail >= buffer) {
+       dropped++;
+       return;
+    }
+    if (chance(drop_rate)) {
+       dropped++;
+       return;
+    }
+    if (chance(error_rate)) {
+       errors++;
+       queue_reply("ERROR");
+       return;
+    }
+
+    if (strcmp(key, "VERSION") == 0) {
+       queue_reply("+VERSION=V1.3-emu");
+       return;
+    } else if (strcmp(key, "MODE") == 0) {
+       struct chan *c = &chans[channel - 1];
+       if (value == NULL) {
+          snprintf(reply, sizeof(reply), "+MODE=%s", c->mode);
+          queue_reply(reply);
+       } else if (strcmp(value, "POINT") == 0 || strcmp(value, "SWEEP") == 0 || strcmp(value, "FSK2") == 0 ||
+                  strcmp(value, "FSK4") == 0 || strcmp(value, "AM") == 0) {
+          snprintf(c->mode, sizeof(c->mode), "%s", value);
+          queue_reply("OK");
+       } else {
+          queue_reply("ERROR");
+       }
+       return;
+    } else if (strcmp(key, "SWEEP") == 0) {
+       struct chan *c = &chans[channel - 1];
+       if (value == NULL) {
+          snprintf(reply, sizeof(reply), "+SWEEP=%s", c->sweep);
+          queue_reply(reply);
+       } else if (strcmp(value, "ON") == 0 || strcmp(value, "OFF") == 0) {
+          snprintf(c->sweep, sizeof(c->sweep), "%s", value);
+          queue_reply("OK");
+       } else {
+          queue_reply("ERROR");
+       }
+       return;
+    }
+
+    for (struct key *k = keys; k->name != NULL; k++) {
+       if (strcmp(k->name, key) == 0) {
+          long *field = k->where(key);
+
+          if (value == NULL) {
+             snprintf(reply, sizeof(reply), "+%s=%ld", key, *field);
+             queue_reply(reply);
+          } else {
+             char *end;
+             long v = strtol(value, &end, 10);
+
+             if (end == value || *end != '\0' || v < k->min || v > k->max) {
+                errors++;
+                queue_reply("ERROR_DATA_OVER_RANGEM");
+             } else {
+                *field = v;
+                queue_reply("OK");
+             }
+          }
+          return;
+       }
+    }
+    queue_reply("ERROR");
+}
+
+void reset_state(void) {
+    for (int i = 0; i < MAX_CHAN; i++) {
+       struct chan *c = &chans[i];
+       memset(c, 0, sizeof(*c));
+       strcpy(c->mode, "POINT");
+       strcpy(c->sweep, "OFF");
+       c->fre = 1000000;
+       c->amp = 1023;
+       c->startfre = 1;
+       c->endfre = 100;
+       c->endamp = 1023;
+       c->step = 1;
+       c->time = 10;
+    }
+}
+
+void show_help(char **argv) {
+    printf("Usage: %s [option] - Emulate an AD9959+stm32 DDS board on a pty\n", argv[0]);
+    printf("\t-h\t\tThis help message\n");
+    printf("\t-l usec\t\tReply latency (default 0)\n");
+    printf("\t-j usec\t\tReply jitter, +/- (default 0)\n");
+    printf("\t-e rate\t\tFraction of commands answered with ERROR (0-1)\n");
+    printf("\t-x rate\t\tFraction of commands never answered (0-1)\n");
+    printf("\t-b count\tLose commands that arrive while count replies are waiting\n");
+    printf("\t-L file\t\tWrite the pty path to file (once it's ready)\n");
+    printf("\t-v\t\tShow commands as they arrive\n");
+}
+
+int main(int argc, char **argv) {
+    const char *link_file = NULL;
+    char buf[4096], line[LINE_SIZE];
+    size_t linelen = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hl:j:e:x:b:L:v")) != -1) {
+        switch (opt) {
+            case 'l':
+                latency = atol(optarg);
+                break;
+            case 'j':
+                jitter = atol(optarg);
+                break;
+            case 'e':
+                error_rate = atof(optarg);
+                break;
+            case 'x':
+                drop_rate = atof(optarg);
+                break;
+            case 'b':
+                buffer = atoi(optarg);
+                break;
+            case 'L':
+                link_file = optarg;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+                show_help(argv);
+                exit(EXIT_SUCCESS);
+            default:
+                show_help(argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+       perror("emu: posix_openpt");
+       exit(EXIT_FAILURE);
+    }
+    const char *slave_name = ptsname(master);
+
+    // hold the slave open so freqgen can come and go, and start it out raw
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave < 0 || tcgetattr(slave, &tio) < 0) {
+       perror("emu: slave");
+       exit(EXIT_FAILURE);
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    reset_state();
+    srandom(getpid());
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    printf("%s\n", slave_name);
+    fflush(stdout);
+    if (link_file) {
+       FILE *fp = fopen(link_file, "w");
+       if (fp == NULL) {
+          perror("emu: link file");
+          exit(EXIT_FAILURE);
+       }
+       fprintf(fp, "%s\n", slave_name);
+       fclose(fp);
+    }
+
+    while (!done) {
+       struct pollfd pfd = { .fd = master, .events = POLLIN };
+       int timeout = -1;
+
+       if (reply_head != reply_tail) {
+          int64_t wait = replies[reply_tail & (REPLY_QUEUE - 1)].due - mono_usec();
+          timeout = (wait > 0 ? (wait + 999) / 1000 : 0);
+       }
+
+       if (poll(&pfd, 1, timeout) < 0) {
+          if (errno == EINTR) {
+             continue;
+          }
+          perror("emu: poll");
+          break;
+       }
+
+       if (pfd.revents & POLLIN) {
+          ssize_t nbytes = read(master, buf, sizeof(buf));
+
+          for (ssize_t i = 0; i < nbytes; i++) {
+             if (buf[i] == '\r' || buf[i] == '\n') {
+                if (linelen > 0) {
+                   line[linelen] = '\0';
+                   handle_line(line);
+                   linelen = 0;
+                }
+             } else if (linelen < sizeof(line) - 1) {
+                line[linelen++] = buf[i];
+             }
+          }
+       }
+
+       // send everything that's due, in one write
+       int64_t now = mono_usec();
+       size_t outlen = 0;
+       while (reply_head != reply_tail && replies[reply_tail & (REPLY_QUEUE - 1)].due <= now) {
+          const char *text = replies[reply_tail & (REPLY_QUEUE - 1)].text;
+          size_t len = strlen(text);
+
+          if (outlen + len > sizeof(buf)) {
+             break;
+          }
+          memcpy(buf + outlen, text, len);
+          outlen += len;
+          reply_tail++;
+       }
+       for (size_t off = 0; off < outlen; ) {
+          ssize_t nbytes = write(master, buf + off, outlen - off);
+          if (nbytes < 0) {
+             if (errno == EINTR) {
+                continue;
+             }
+             perror("emu: write");
+             exit(EXIT_FAILURE);
+          }
+          off += nbytes;
+       }
+    }
+
+    fprintf(stderr, "emu: %lu commands, %lu errors, %lu dropped\n", commands, errors, dropped);
+    return 0;
+}
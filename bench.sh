@@ -0,0 +1,90 @@
+#!/bin/bash
+# End to end benchmark: runs freqgen against ad9959-emu and reports
+# commands/second, setup script wall time and CPU per command.
+# 'bench.sh parse' times the parsers instead, against bench-parse.baseline
+# (written if it isn't there), and fuzzes them. 'bench.sh fuzz' only fuzzes.
+# Either fails if a parser got slower, accepted a bad value or hit a slow path.
+#
+# Environment:
+#	BENCH_LINES	console commands to push through (default 20000)
+#	PARSE_ROUNDS	passes over each parser's corpus (default 20000)
+#	FUZZ_RUNS	fuzzed inputs (default 1000000)
+#	EMU_FLAGS	extra ad9959-emu options, ie "-l 200 -j 50" for latency
+#	FREQGEN	freqgen binary to run (default ./freqgen)
+#	FREQGEN_FLAGS	extra freqgen options, ie "-w 16"
+set -e
+
+top=$(cd "$(dirname "$0")" && pwd)
+mode=${1:-link}
+freqgen=$(realpath "${FREQGEN:-${top}/freqgen}")
+lines=${BENCH_LINES:-20000}
+tmp=$(mktemp -d)
+emu_pid=
+
+cleanup() {
+   [ -n "${emu_pid}" ] && kill ${emu_pid} 2>/dev/null && wait ${emu_pid} 2>/dev/null
+   rm -rf "${tmp}"
+}
+trap cleanup EXIT
+
+calc() {
+   awk "BEGIN { print $1 }"
+}
+
+# run <name> <freqgen args...> < input
+# Runs freqgen against a fresh emulator, leaving wall, cpu (seconds) and
+# at (AT commands the emulator saw) behind.
+run() {
+   local name=$1
+   shift
+
+   rm -f "${tmp}/pty"
+   "${top}/ad9959-emu" -L "${tmp}/pty" ${EMU_FLAGS} >/dev/null 2> "${tmp}/${name}.emu" &
+   emu_pid=$!
+   for i in $(seq 50); do
+      [ -s "${tmp}/pty" ] && break
+      sleep 0.1
+   done
+
+   TIMEFORMAT="%R %U %S"
+   { time "${freqgen}" -p "$(cat "${tmp}/pty")" ${FREQGEN_FLAGS} "$@" > "${tmp}/${name}.out" ; } 2> "${tmp}/${name}.time"
+   kill ${emu_pid}
+   wait ${emu_pid} || true
+   emu_pid=
+
+   read wall user sys < <(tail -1 "${tmp}/${name}.time")
+   cpu=$(calc "${user} + ${sys}")
+   at=$(sed -n 's/^emu: \([0-9]*\) commands.*/\1/p' "${tmp}/${name}.emu")
+}
+
+# the lockfile goes in the current directory
+cd "${tmp}"
+
+if [ "${mode}" = parse ] || [ "${mode}" = fuzz ]; then
+   echo "* freqgen parser bench (${freqgen##*/})"
+   {
+      [ "${mode}" = parse ] && echo "bench parse ${PARSE_ROUNDS:-20000} ${top}/bench-parse.baseline"
+      echo "bench fuzz ${FUZZ_RUNS:-1000000}"
+   } > parse.in
+   run parse < parse.in
+   grep -E '^\*+ (Parse|Fuzz)' "${tmp}/parse.out"
+   ! grep -q '^\*\*\* \(Parse\|Fuzz\)' "${tmp}/parse.out"
+   exit
+fi
+echo "* freqgen bench (emulator flags: ${EMU_FLAGS:-none}, freqgen flags: ${FREQGEN_FLAGS:-none})"
+
+# setup script, as shipped
+run setup -l "${top}/scripts/2m-call.scl" < /dev/null
+printf "* Setup script (2m-call.scl): %.3f s wall, %d AT commands\n" "${wall}" "${at}"
+
+# same script without its sleeps, so it's just the link
+sed '/^sleep/d' "${top}/scripts/2m-call.scl" > nosleep.scl
+run nosleep -l nosleep.scl < /dev/null
+printf "* Setup script without sleeps: %.3f s wall, %d AT commands\n" "${wall}" "${at}"
+
+# a stream of sets, each a different value so the cache can't skip them
+awk -v n="${lines}" 'BEGIN { for (i = 0; i < n; i++) printf("freq %d\n", 1000000 + i) }' > stream.in
+run stream < stream.in
+printf "* Command stream: %d lines in %.3f s wall (%.0f lines/s), %d AT commands (%.0f/s)\n" \
+       "${lines}" "${wall}" "$(calc "${lines} / ${wall}")" "${at}" "$(calc "${at} / ${wall}")"
+printf "* CPU: %.3f s user+sys, %.2f us per AT command\n" "${cpu}" "$(calc "${cpu} * 1000000 / ${at}")"
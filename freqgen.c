@@ -4,29 +4,48 @@
  * Sorry if it's messy, it was mostly thrown together on a monday morning!
  *
  * Build as such:
- * 	cc -ggdb -Wall -pedantic -o freqgen freqgen.c -lreadline -lev
+ * 	cc -ggdb -Wall -pedantic -O3 -fno-trapping-math -c plan-quantize.c
+ * 	cc -ggdb -Wall -pedantic -o freqgen freqgen.c plan-quantize.o -lreadline -lev -lm
  *
- * XXX: Implement -x to execute a one-off command from command line
- * XXX: Implement -l and -s for load and save (also load and save commands)
+ * XXX: Implement -s for save
  * XXX: Deal with autoreconnecting
  */
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <ev.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <getopt.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <sys/file.h>
-#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sched.h>
+#include <readline/readline.h>
+#include <readline/history.h>
 
 #define VERSION "2024-02-19.02"
 #define BUFFER_SIZE 	512		// this should be plenty
+#define RING_SIZE	4096		// serial receive ring (must be a power of 2)
 
 #define	DEFAULT_PORT "/dev/ttyACM0"
 
@@ -37,10 +56,35 @@
 
 // Configuration of things that shouldn't need changed unless using a different board...
 #define	MAX_CHAN	4		// how many channels? ad9959 has 4...
-#define	MAX_ARGS	5		// max arguments to a function...
+#define	MAX_BOARDS	16		// boards one process can drive
+#define	MAX_ARGS	8		// max arguments to a function...
 #define	MAX_FREQ	200000000
 #define	MIN_FREQ	1
 
+// AT command queue
+#define	CMDQ_SIZE	256		// commands queued (in flight + waiting), power of 2
+#define	CMDQ_WINDOW	8		// default max commands in flight
+#define	CMD_TIMEOUT	1000		// default ms to wait for a reply
+#define	CMD_NOREPLY	0x01		// command doesn't get a reply (ie AT+RESET)
+#define	CMD_HOP_END	0x02		// last command of a hop, its reply completes the hop
+#define	CMD_PROBE_END	0x04		// last command of a snapshot check
+#define	CMD_CAL		0x08		// calibration probe, its reply goes to cal_reply()
+#define	CMD_REPLAY	0x10		// from a trace being replayed, never written to the port
+#define	CAL_BURST	64		// probes per calibration step
+#define	PACE_RECOVER	32		// clean replies before a backed off window opens up by one
+#define	TX_MAX_BATCH	64		// max commands per writev()
+#define	CACHE_TTL	10000		// default ms a confirmed value answers show commands
+#define	MAX_SLEEP	60000		// longest 'sleep' allowed, ms
+#define	MAX_CLIENTS	64		// daemon socket connections
+#define	CLIENT_MAX_OUT	(256 * 1024)	// output a client can fall behind by before it's dropped
+#define	CLIENT_DONE	"* Hangup:"	// a client's last line, with how many of its commands failed
+#define	JSON_BUF	(64 * 1024)	// -J output buffer, flushed once per loop
+#define	TRACE_SIZE	16384		// serial frames the flight recorder keeps (power of 2)
+#define	TRACE_MAGIC	0x52544746	// "FGTR"
+#define	PLAN_MAGIC	0x4e4c5046	// "FPLN"
+#define	PLAN_BLOCK	4096		// points converted at a time
+#define	PLAN_MAX	50000000	// points in a plan
+
 struct cmds {
    char *name;
    int  min_args;
@@ -50,17 +94,155 @@ struct cmds {
 };
 
 // Defaults (cmdline config)
-char *serial_port = DEFAULT_PORT;
+int cmdq_window = CMDQ_WINDOW;	// -w, for every board
+int cmdq_window_set = 0;	// -w given, it wins over a board's .pace
 int debug = 0;
 
+// receive ring: bytes are read in as large chunks as are available and
+// complete lines are split out afterwards. head/tail are free-running
+// counters, masked with (RING_SIZE - 1) when indexing data[].
+struct line_ring {
+    char data[RING_SIZE];
+    size_t head;	// write position
+    size_t tail;	// start of the current (incomplete) line
+    size_t scan;	// how far we've looked for a line ending
+    unsigned long reads, ioctls, bytes, lines;	// syscalls made, bytes read, lines split out
+};
+
+// An AT command we've queued. Replies come back in order, so the oldest
+// in-flight command owns the next OK, ERROR_* or +KEY= line we read.
+struct at_cmd {
+    char line[64];		// command as sent, ie "AT+FRE+1000"
+    char key[12];		// reply key, ie "FRE"
+    int query;			// queries complete on +KEY=, sets on OK
+    int chan;			// channel selected when it was queued
+    int field;			// mirrored field it reads/writes (-1 if none)
+    int flags;
+    int client;			// daemon client that queued it (0 for the console)
+    int64_t sent;		// when it was written (usec, 0 if not yet)
+    int64_t deadline;
+};
+
+struct cmd_queue {
+    struct at_cmd cmds[CMDQ_SIZE];
+    unsigned head;		// next free slot
+    unsigned tail;		// oldest command (in flight, if inflight > 0)
+    unsigned inflight;
+    int window;			// max commands in flight
+    int timeout;		// ms
+    unsigned long completed, errors, timeouts, stray;
+};
+
+// Commands released from the queue are gathered here and written out
+// together, one writev() per loop iteration (or per TX_MAX_BATCH commands).
+struct tx_batch {
+    struct at_cmd *cmds[TX_MAX_BATCH];
+    int count;
+    unsigned long flushes, frames, bytes, max_batch;
+    unsigned long hist[7];	// flushes carrying 1, 2, 3-4, 5-8, 9-16, 17-32, 33+ commands
+};
+
+// Reply latency (write to matching reply) per command type. Buckets are
+// log-linear: 4 per power of 2 of usec, so percentiles are within ~20%.
+#define	LAT_BUCKETS	108
+
+struct lat_stats {
+    unsigned long count, errors, timeouts;
+    int64_t sum, max;		// usec
+    unsigned long hist[LAT_BUCKETS];
+};
+
+// How fast a board can be driven. calibrate measures it and saves it in
+// <port>.pace, which is loaded when the port's opened. The window drops
+// when the board times out or garbles a command and creeps back up to
+// ceiling once it's answering cleanly again.
+struct pace {
+    int window;			// calibrated window (0 = never calibrated)
+    int timeout;		// calibrated reply timeout, ms
+    int limit;			// window it started losing replies at (0 = didn't)
+    int64_t rtt;		// one command's turnaround, usec
+    double rate;		// commands/s at window
+    int ceiling;		// window to recover to
+    int calibrating;
+    unsigned long clean;	// clean replies since the window last moved
+    unsigned long backoffs;
+    int64_t backed_off;		// when (commands sent before then don't count again)
+};
+
 // run-time state
-char read_buffer[BUFFER_SIZE];
-int buffer_index = 0;
+struct line_ring stdin_rx;
+struct ev_loop *loop;
+ev_io stdin_watcher;
+ev_timer sleep_timer;		// script/console 'sleep', holds back further input
+ev_prepare input_prepare;	// picks input back up once the queue has room
+ev_prepare tx_prepare;		// flushes the tx batch before we go back to sleep
+ev_signal quit_signals[2];	// SIGINT, SIGTERM
+int input_busy = 0;		// inside handle_command()
+int input_eof = 0;
+int input_tty = 0;		// stdin's a terminal: line editing, else read it in blocks
+FILE *json_out = NULL;		// -J: a JSON line per event goes here
+const char *quit_msg = NULL;	// exit once the queue drains, saying this
 int starting_up = 1;
-char brd_ver[32];	// board version
-int ref_clk = 25000000; // reference clock
-int clk_mult = 1;	// clock multiplier
-int curr_chan = 1;
+int exec_mode = 0;		// -x: quietly run the commands given and exit
+int script_hold = 0;		// don't start the script until every board is idle
+FILE *cons_out;			// the console's text, stdout (set in main())
+FILE *msg_out;			// out_printf() goes here: cons_out, the client we're working for, or nowhere
+
+// Everything we have to say goes through here rather than printf(), so it
+// goes to whoever we're working for without touching stdout itself
+void out_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void out_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(msg_out, format, args);
+    va_end(args);
+}
+
+// Everything we mirror from the board. Fields before F_CHAN are per channel.
+enum state_field {
+    F_MODE, F_FREQ, F_PHASE, F_POWER,
+    F_START_FREQ, F_END_FREQ, F_START_POWER, F_END_POWER, F_STEP, F_TIME, F_SWEEP,
+    F_CHAN, F_REF, F_MULT, F_VERSION,
+    F_MAX
+};
+
+struct field_info {
+    const char *name;		// console command
+    const char *key;		// AT+<key>
+} fields[F_MAX] = {
+    [F_MODE] =        { "mode",       "MODE" },
+    [F_FREQ] =        { "freq",       "FRE" },
+    [F_PHASE] =       { "phase",      "PHA" },
+    [F_POWER] =       { "power",      "AMP" },
+    [F_START_FREQ] =  { "startfreq",  "STARTFRE" },
+    [F_END_FREQ] =    { "endfreq",    "ENDFRE" },
+    [F_START_POWER] = { "startpower", "STARTAMP" },
+    [F_END_POWER] =   { "endpower",   "ENDAMP" },
+    [F_STEP] =        { "step",       "STEP" },
+    [F_TIME] =        { "time",       "TIME" },
+    [F_SWEEP] =       { "sweep",      "SWEEP" },
+    [F_CHAN] =        { "chan",       "CHANNEL" },
+    [F_REF] =         { "ref",        "REF" },
+    [F_MULT] =        { "mult",       "MULT" },
+    [F_VERSION] =     { "ver",        "VERSION" },
+};
+
+// What we know about one mirrored field
+struct field_meta {
+    int64_t confirmed;		// when the board last reported it (usec, 0 = never)
+    unsigned dirty:1;		// we've changed it (or the mode changed) since
+    unsigned pending:1;		// a query for it is queued
+};
+
+// When to re-read channel state from the board
+enum refresh_policy {
+    REFRESH_EAGER,		// on channel switch, re-read anything unknown, stale or dirty
+    REFRESH_LAZY,		// only when shown, sets are still read back
+    REFRESH_NEVER		// never, sets are trusted once OK'd
+};
+const char *refresh_names[] = { "eager", "lazy", "never" };
+
 struct ChannelState {
     int power;
     int phase;
@@ -73,15 +255,107 @@ struct ChannelState {
         sweep_start_freq,
         sweep_end_freq,
         sweep_step;
+    struct field_meta meta[F_CHAN];
+};
+int refresh_policy = REFRESH_EAGER;
+
+// Mirrored state saved at exit and loaded at startup, so all it takes to
+// trust it again is a check that it's the same board in the same state.
+#define	SNAP_MAGIC	0x31534746	// "FGS1"
+
+struct snapshot {
+    uint32_t magic;
+    uint32_t size;		// sizeof(struct snapshot), a layout change reads as a mismatch
+    char port[128];
+    char ver[32];
+    int ref_clk, clk_mult, curr_chan;
+    struct ChannelState chan_state[MAX_CHAN];	// meta[].confirmed is 1 if the value's good
+    struct field_meta meta[F_MAX];
+    uint32_t sum;		// FNV-1a of everything above
 };
-struct ChannelState chan_state[MAX_CHAN];
+
+// Everything about one board: its port, what's in flight to it and what
+// we know of its state. Commands and replies work on brd, which is pointed
+// at the board being talked to before they run.
+struct board {
+    char *port;
+    int fd;
+    struct line_ring rx;
+    struct cmd_queue cmdq;
+    struct tx_batch tx;
+    ev_io watcher;
+    ev_timer cmdq_timer;	// fires when the oldest in-flight command times out
+    char ver[32];		// board version
+    int ref_clk;		// reference clock
+    int clk_mult;		// clock multiplier
+    int curr_chan;
+    struct ChannelState chan_state[MAX_CHAN];
+    struct field_meta meta[F_MAX];	// same, for the board-wide fields (F_CHAN and up)
+    struct lat_stats cmd_stats[F_MAX + 1][2];	// latency, by [field (F_MAX = anything else)][set, query]
+    struct pace pace;
+    struct snapshot snap;	// saved state, kept until it's checked (or to merge with under -x)
+    int snap_loaded;
+    int probing;		// checking snap against the board, input waits (2 = asked for the frequency)
+    int replaying;		// a trace is being fed through process_line(), input but trace waits
+    int probe_chan;		// channel the board says it's on
+};
+struct board boards[MAX_BOARDS];
+int num_boards = 0;
+struct board *brd = &boards[0];		// board we're working on right now
+struct board *sel_board = &boards[0];	// board console commands go to by default
+
+// A connection to the daemon socket. Each gets its own input ring, sleep
+// and selected board, and the output of its commands (including replies
+// that come in later) is sent back to it and nobody else.
+struct client {
+    int id;
+    int fd;
+    struct line_ring rx;
+    ev_io watcher;
+    ev_io tx_watcher;		// running while output is backed up
+    ev_timer sleep_timer;
+    FILE *out;			// out_printf()s go here while we work for it
+    char *obuf;
+    size_t olen, osent;
+    struct board *board;	// its selected board
+    int pending;		// commands it's queued that haven't been answered
+    int errors, timeouts;	// its commands the board (or we) rejected, or that went unanswered
+    int eof, closing;
+    struct client *next;
+};
+struct client *clients = NULL;
+int num_clients = 0;
+struct client *cur_client = NULL;	// client we're working for right now (NULL for the console)
+int listen_fds[2] = { -1, -1 };		// unix, tcp
+ev_io listen_watchers[2];
+char *daemon_path = NULL;		// -D
+int daemon_tcp = 0;			// -T
+
+struct client *client_by_id(int id);
+void client_enter(struct client *c);
+
+// Put in front of anything a board tells us, when there's more than one
+const char *board_tag(void) {
+    static char tag[24];
+
+    if (num_boards <= 1) {
+       return "";
+    }
+    snprintf(tag, sizeof(tag), "board%d: ", (int)(brd - boards) + 1);
+    return tag;
+}
+
+// shadow register cache
+int cache_ttl = CACHE_TTL;	// ms, 0 disables the cache
+int force_query = 0;		// set while running a command given with 'force'
+unsigned long cache_hits, cache_skips;
 
 /////////////////////////////////////////////////
 int open_serial_port(const char *port_name) {
     int fd = open(port_name, O_RDWR | O_NOCTTY);
     if (fd == -1) {
         int my_errno = errno;
-        printf("Error opening serial port at %s: %d:%s\n", port_name, my_errno, strerror(my_errno));
+        out_printf("Error opening serial port at %s: %d:%s\n", port_name, my_errno, strerror(my_errno));
         exit(EXIT_FAILURE);
     }
     return fd;
@@ -144,74 +418,109 @@ int convertPowerToAmplitude(double power) {
     return (int)round((power / 100.0) * 1023);
 }
 
-double stringToDouble(const char *str) {
-    // Convert string to double
-    return strtod(str, NULL);
+// Parse a plain number, the whole string must be used. Returns -1 if it isn't a number.
+int parse_number(const char *str, double *value) {
+    char *endptr;
+
+    *value = strtod(str, &endptr);
+    if (endptr == str || *endptr != '\0' || !isfinite(*value)) {
+       return -1;
+    }
+    return 0;
 }
 
-double convert_to_hertz(const char *frequency) {
+// Parse a frequency with optional k/m/g suffix (and hz), ie 146.52m or 10 kHz.
+// Returns -1 if it doesn't look like one.
+int parse_hertz(const char *frequency, double *hz) {
     double multiplier = 1.0;
     char *endptr;
     double value = strtod(frequency, &endptr);
 
-    if (endptr != frequency) {
-        while (isspace(*endptr)) {
-            endptr++;
-        }
+    if (endptr == frequency || !isfinite(value)) {
+        return -1;
+    }
 
-        if (*endptr != '\0') {
-            switch (*endptr) {
-                case 'k': case 'K':
-                    multiplier = 1000.0;
-                    break;
-                case 'm': case 'M':
-                    multiplier = 1000000.0;
-                    break;
-                case 'g': case 'G':
-                    multiplier = 1000000000.0;
-                    break;
-                default:
-                    fprintf(stderr, "Invalid suffix in frequency: %s\n", frequency);
-                    exit(EXIT_FAILURE);
-            }
-        }
-    } else {
-        fprintf(stderr, "Invalid frequency format: %s\n", frequency);
-        exit(EXIT_FAILURE);
+    while (isspace(*endptr)) {
+        endptr++;
+    }
+
+    switch (*endptr) {
+        case 'k': case 'K':
+            multiplier = 1000.0;
+            endptr++;
+            break;
+        case 'm': case 'M':
+            multiplier = 1000000.0;
+            endptr++;
+            break;
+        case 'g': case 'G':
+            multiplier = 1000000000.0;
+            endptr++;
+            break;
+    }
+    if (strncasecmp(endptr, "hz", 2) == 0) {
+        endptr += 2;
+    }
+    if (*endptr != '\0') {
+        return -1;
     }
 
-    return value * multiplier;
+    *hz = value * multiplier;
+    return isfinite(*hz) ? 0 : -1;
 }
 
+double field_value(int chan, int f);
+
+// Write what we know of the board as a config that load or apply can use.
+// Only fields we've actually seen are written, so it never asks for a 0 Hz
+// frequency just because we didn't know.
 void save_config(const char *path) {
-    // XXX: refresh_channels();
     FILE *fp = fopen(path, "w");
 
+    if (fp == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error opening %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       return;
+    }
+
     // Print board config
-    fprintf(fp, "ref %d\n", ref_clk);
-    fprintf(fp, "mult %d\n", clk_mult);
-    fprintf(fp, "sleep 200\n");
-
-    for (int i = 0; i < (MAX_CHAN - 1); i++) {
-        // Save our in-memory data
-        fprintf(fp, "chan %d\n", i);
-        fprintf(fp, "mode %s\n", chan_state[i].mode);
-        fprintf(fp, "sleep 100\n");
-
-        if (strcasecmp("POINT", chan_state[i].mode) == 0) {
-           fprintf(fp, "freq %.0f\n",    chan_state[i].freq);
-           fprintf(fp, "phase %d\n", chan_state[i].phase);
-           fprintf(fp, "power %d\n",   chan_state[i].power);
-        } else if (strcasecmp("SWEEP", chan_state[i].mode) == 0) {
-           fprintf(fp, "endfreq %.0f\n", chan_state[i].sweep_end_freq);
-           fprintf(fp, "startfreq %.0f\n", chan_state[i].sweep_start_freq);
-           fprintf(fp, "endpower %d\n", chan_state[i].sweep_end_power);
-           fprintf(fp, "startpower %d\n", chan_state[i].sweep_end_power);
-           fprintf(fp, "step %.0f\n",    chan_state[i].sweep_step);
-           fprintf(fp, "time %d\n",    chan_state[i].sweep_time);
-           fprintf(fp, "sweep %s\n",  (chan_state[i].sweep_active ? "on" : "off"));
-        } // other modes not supported by hardware so ignored for now...
+    if (brd->meta[F_REF].confirmed) {
+       fprintf(fp, "ref %d\n", brd->ref_clk);
+    }
+    if (brd->meta[F_MULT].confirmed) {
+       fprintf(fp, "mult %d\n", brd->clk_mult);
+    }
+
+    for (int chan = 1; chan <= MAX_CHAN; chan++) {
+        struct ChannelState *cs = &brd->chan_state[chan-1];
+
+        if (!cs->meta[F_MODE].confirmed) {
+           fprintf(fp, "# chan %d: not read from the board\n", chan);
+           continue;
+        }
+        // Save our in-memory data, mode first as changing it resets the rest
+        fprintf(fp, "chan %d\n", chan);
+        fprintf(fp, "mode %s\n", cs->mode);
+
+        for (int f = F_FREQ; f < F_CHAN; f++) {
+           if (!cs->meta[f].confirmed) {
+              continue;
+           }
+           switch (f) {
+              case F_PHASE:
+                 // in degrees, precisely enough to come back as the same value
+                 fprintf(fp, "phase %.4f\n", cs->phase * 360.0 / 16383);
+                 break;
+              case F_SWEEP:
+                 fprintf(fp, "sweep %s\n", (cs->sweep_active ? "on" : "off"));
+                 break;
+              default:
+                 fprintf(fp, "%s %.0f\n", fields[f].name, field_value(chan, f));
+                 break;
+           }
+        }
     }
+    fprintf(fp, "chan %d\n", brd->curr_chan);
     fclose(fp);
 }
 
@@ -222,24 +531,39 @@ void c_phase(); void c_quit(); void c_ref(); void c_reset();
 void c_restore(); void c_save(); void c_startpower(); void c_endpower();
 void c_startfreq(); void c_endfreq(); void c_version(); void c_step();
 void c_time(); void c_sweep(); void c_info(); void c_sleep();
+void c_timeout(); void c_window(); void c_stats(); void c_cache();
+void c_refresh(); void c_bench(); void c_hop(); void c_hsweep();
+void c_board(); void c_apply(); void c_calibrate(); void c_plan();
+void c_trace(); void c_key();
 
 struct cmds cons_cmds[] = {
+    { "apply",      1, 1, c_apply,      "Change only what differs from a saved config" },
+    { "bench",      0, 3, c_bench,      "Benchmark reply/command dispatch [rounds] | PARSE [rounds] [baseline] | FUZZ [runs] [seed]" },
+    { "board",      0, 1, c_board,      "List boards or select the one commands go to [1-16]" },
+    { "calibrate",  0, 0, c_calibrate,  "Measure how fast the board can take commands and save it" },
+    { "cache",      0, 1, c_cache,      "Show/set state cache lifetime [0-3600000] ms | off | flush" },
     { "chan", 	    0, 1, c_chan,	"Show/set channel [1-4]" },
     { "debug",      0, 1, c_debug,      "Show/set debug level [0-10]" },
     { "factory",    1, 1, c_restore, 	"Restore factory settings (must pass CONFIRM as arg!)" },
     { "freq",	    0, 1, c_freq,	"Show/set frequency [1-200,000,000] Hz" },
     { "help", 	    0, 0, c_help,	"This help message" },
+    { "hop",        0, 3, c_hop,        "Frequency hopping: LOAD file [plan chan] | RUN [dwell ms] [hops] | NEXT | STOP" },
+    { "hsweep",     0, 7, c_hsweep,     "Host sweep: LIN|LOG start end points dwell [startpower [endpower]] | LIST file [dwell] | RUN [loops] | STOP | CLEAR" },
     { "info",       0, 1, c_info,       "Show board information" },
-    { "load",       0, 1, c_load,       "Load settings from stdin or file" },
+    { "key",        0, MAX_ARGS, c_key, "Host keying: CW wpm text | FSK base spacing baud symbols | TONE freq ms | GAP ms | RUN [loops] [period s] | STOP | CLEAR | RT [prio|OFF]" },
+    { "load",       0, 1, c_load,       "Run a script (.scl) file" },
     { "mode",	    0, 1, c_mode,	"Show/set mode [POINT|SWEEP|FSK2|FSK4|AM]" },
     { "mult",	    0, 1, c_mult,	"Show/set refclk multiplier [1-20]" },
     { "phase",      0, 1, c_phase,      "Show/set phase [0.0-360.0] degrees" },
+    { "plan",       1, 5, c_plan,       "Frequency plan: LIN|LOG start end points file | RASTER start spacing count file | file" },
     { "power",      0, 1, c_power,      "Show/set power [0-1023] | [0-100%]" },
     { "quit",       0, 0, c_quit,       "Exit the program" },
     { "ref",	    0, 1, c_ref,	"Show/set refclk frequency [10,000,000-125,000,000] Hz" },
+    { "refresh",    0, 1, c_refresh,    "Show/set state refresh policy [EAGER|LAZY|NEVER] or refresh NOW" },
     { "reset", 	    0, 0, c_reset,      "Reset the board" },
     { "save",       0, 1, c_save,       "Save the settings to stdout or file" },
     { "sleep",      1, 1, c_sleep,      "Sleep x ms" },
+    { "stats",      0, 2, c_stats,      "Show serial traffic and command latency statistics [JSON [file] | RESET]" },
     { "endpower",   0, 1, c_endpower,   "Show/set sweep END power [0-1023] | [0-100%]" },
     { "endfreq",    0, 1, c_endfreq,    "Show/set sweep END frequency [STARTFRE-200,000,000]" },
     { "startpower", 0, 1, c_startpower, "Show/set sweep START power [0-1023] | [0-100%]" },
@@ -247,455 +571,5467 @@ struct cmds cons_cmds[] = {
     { "step",       0, 1, c_step,       "Show/set sweep STEP interval [1-200,000,000] Hz" },
     { "sweep",      0, 1, c_sweep,      "Show/set sweep status [ON|OFF]" },
     { "time",       0, 1, c_time,       "Show/set sweep time [1-9999] ms" },
+    { "timeout",    0, 1, c_timeout,    "Show/set reply timeout [1-60000] ms" },
+    { "trace",      0, 3, c_trace,      "Serial flight recorder: DUMP [file] | REPLAY file [speed] | STOP | CLEAR" },
     { "ver", 	    0, 0, c_version,	"Show firmware version" },
+    { "window",     0, 1, c_window,     "Show/set max commands in flight [1-64]" },
     { (char *)NULL, 0, 0,  NULL,             NULL }
 };
 
-void send_command(int fd, const char *format, ...) {
-    char buffer[BUFFER_SIZE];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(buffer, BUFFER_SIZE, format, args);
-    va_end(args);
-    
-    if (debug) {
-       printf("ser_send: %s\n", buffer);
-    }
+void serial_read_cb(int fd);
 
-    write(fd, buffer, strlen(buffer));
-    write(fd, "\r\n", 2);
+int64_t mono_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void c_chan(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-        curr_chan = atoi(argv[0]);
-
-        if (debug) {
-           printf("Selecting channel %i\n", curr_chan);
-        }
-        send_command(fd, "AT+CHANNEL+%i", curr_chan);
-    }
-    send_command(fd, "AT+CHANNEL");
+struct field_meta *field_meta(int chan, int f) {
+    return (f < F_CHAN ? &brd->chan_state[chan-1].meta[f] : &brd->meta[f]);
 }
 
-void c_debug(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int new_debug = atoi(argv[0]);
-       printf("* Changing debug level from %d to %d\n", debug, new_debug);
-       debug = new_debug;
-    } else {
-       printf("* Debug level: %d\n", debug);
-    }
+// The board just told us the current value of f
+void field_confirm(int chan, int f) {
+    struct field_meta *m = field_meta(chan, f);
+    m->confirmed = mono_usec();
+    m->dirty = 0;
+    m->pending = 0;
 }
 
-void c_endfreq(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      double new_freq = convert_to_hertz(argv[0]);
-      if (new_freq < MIN_FREQ || new_freq > MAX_FREQ) {
-         printf("*** Invalid argument to endfreq: Value %f out of bounds [STARTFRE-200,000,000]\n", new_freq);
-         return;
-      }
-      send_command(fd, "AT+ENDFRE+%d", new_freq);
-   }
-   send_command(fd, "AT+ENDFRE");
-}
+// Is the mirrored value of f something we can rely on right now?
+int field_fresh(int chan, int f) {
+    struct field_meta *m = field_meta(chan, f);
 
-void c_endpower(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      int new_amp = atoi(argv[0]);
-      if (new_amp < 0 || new_amp > 1023) {
-         printf("*** Invalid argument to endpower: Value %d out of bounds [0-1023]\n", new_amp);
-         return;
-      }
-      send_command(fd, "AT+ENDAMP+%d", new_amp);
-   }
-   send_command(fd, "AT+ENDAMP");
+    return (m->confirmed != 0 && !m->dirty &&
+            (mono_usec() - m->confirmed) <= (int64_t)cache_ttl * 1000);
 }
 
-void c_freq(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-        double new_freq = convert_to_hertz(argv[0]);
+// Perfect hash for looking up a name in a fixed set in one probe. The seed
+// is searched for at startup until every name gets its own slot, so adding
+// a command or reply key never needs anything regenerated by hand.
+#define	PHASH_SIZE	128		// slots, power of 2 and well over the names we hash
 
-        if (new_freq < MIN_FREQ || new_freq > MAX_FREQ) {
-           printf("* Frequency %f is outside limits [%d - %d]\n", new_freq, MIN_FREQ, MAX_FREQ);
-           return;
-        }
-        if (debug) {
-           printf("Setting channel %d frequency to %s\n", curr_chan, argv[0]);
-        }
-        send_command(fd, "AT+FRE+%.0f", new_freq);
+struct phash {
+    uint32_t seed;
+    const char *name[PHASH_SIZE];
+    int16_t idx[PHASH_SIZE];	// what the name maps to, -1 for empty slots
+};
+struct phash reply_hash;	// fields[].key -> field
+struct phash cmd_hash;		// cons_cmds[].name -> index
+
+static uint32_t phash_fn(uint32_t seed, const char *s, size_t len) {
+    uint32_t h = 2166136261u ^ seed;
+
+    // FNV-1a, case folded since commands are case insensitive
+    for (size_t i = 0; i < len; i++) {
+       h = (h ^ (unsigned char)(s[i] | 0x20)) * 16777619u;
     }
-    send_command(fd, "AT+FRE");
+    return (h ^ (h >> 15)) & (PHASH_SIZE - 1);
 }
 
-void c_help(int fd, char *argv[], int argc) {
-    struct cmds *c;
-    printf("****\n");
-    printf("AD9959 controller help:\n");
-    printf("Frequencies can be specified human friendly (ex: 146.52m)\n");
-    printf("Power levels can be given as percent (ex: 90.0%%)\n");
-    printf("Phase angles shall be given as degrees (ex: 90.0)\n");
-    printf("* name\tmin/max args\tDescription\n");
-    int i = 0;
-    while (i < 100) {
-       c = &cons_cmds[i];
+void phash_build(struct phash *h, const char *names[], int count) {
+    for (h->seed = 0; h->seed < 100000; h->seed++) {
+       int i;
 
-       // is this the last record?
-       if (c->func == NULL && c->min_args == 0 && c->max_args == 0) {
-          break;
+       memset(h->idx, 0xff, sizeof(h->idx));
+       for (i = 0; i < count; i++) {
+          uint32_t slot = phash_fn(h->seed, names[i], strlen(names[i]));
+
+          if (h->idx[slot] >= 0) {
+             break;
+          }
+          h->idx[slot] = i;
+          h->name[slot] = names[i];
+       }
+       if (i == count) {
+          return;
        }
-       printf("%s\t\t%d, %d\t%s\n", c->name, c->min_args, c->max_args, c->msg);
-       i++;
     }
-    printf("****\n");
+    fprintf(stderr, "phash_build: no perfect hash for %d names, raise PHASH_SIZE\n", count);
+    abort();
 }
 
-void c_info(int fd, char *argv[], int argc) {
-    c_version(fd, NULL, 0);
-    c_ref(fd, NULL, 0);
-    c_mult(fd, NULL, 0);
-    c_chan(fd, NULL, 0);
-
-    // clear starting flag
-    starting_up = 0;
-}
+int phash_lookup(const struct phash *h, const char *s, size_t len) {
+    uint32_t slot = phash_fn(h->seed, s, len);
+    int i = h->idx[slot];
 
-void c_load(int fd, char *argv[], int argc) {
-    // Load a configuration from a file
-    if (argc > 0) {
-       printf("Not yet implemented: load\n");
-    } else {
-       printf("*** No script file name give!\n");
+    if (i < 0 || strncasecmp(h->name[slot], s, len) != 0 || h->name[slot][len] != '\0') {
+       return -1;
     }
+    return i;
 }
 
-void c_mode(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-        char *mode = strdup(argv[0]);
-        if (!mode) {
-           abort();
-        }
-        uppercase(mode);
-        if (debug) {
-           printf("Setting channel %d mode to %s\n", curr_chan, mode);
-        }
-        send_command(fd, "AT+MODE+%s", mode);
-        free(mode);
+void dispatch_init(void) {
+    const char *names[PHASH_SIZE];
+    int n;
+
+    for (n = 0; n < F_MAX; n++) {
+       names[n] = fields[n].key;
     }
-    send_command(fd, "AT+MODE");
-}
+    phash_build(&reply_hash, names, n);
 
-void c_mult(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int new_mult = convert_to_hertz(argv[0]);
-       printf("* Setting mult to %d Hz\n", new_mult);
-       send_command(fd, "AT+MULT+%d", new_mult);
+    for (n = 0; cons_cmds[n].name != NULL; n++) {
+       names[n] = cons_cmds[n].name;
     }
-    send_command(fd, "AT+MULT");
+    phash_build(&cmd_hash, names, n);
 }
 
-void c_phase(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       double new_angle = stringToDouble(argv[0]);
-       int new_phase = convertAngleToPhase(new_angle);
-       printf("- Chan %d changing phase to %.1f (%d)\n", curr_chan, new_angle, new_phase);
-       send_command(fd, "AT+PHA+%d", new_phase);
-    }
-    send_command(fd, "AT+PHA");
+int field_by_key(const char *key, size_t klen) {
+    return phash_lookup(&reply_hash, key, klen);
 }
 
-void c_power(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int new_amp = atoi(argv[0]);
-       char *percent_p = strchr(argv[0], '%');
+struct cmds *cmd_by_name(const char *name) {
+    int i = phash_lookup(&cmd_hash, name, strlen(name));
+    return (i < 0 ? NULL : &cons_cmds[i]);
+}
 
-       if (percent_p != NULL) {
-          new_amp = convertPowerToAmplitude(new_amp);
-       }
-       if (new_amp < 0 || new_amp > 1023) {
-           printf("*** Invalid value (%s) for GIVEN given: range 0-1023 or 0-100%%\n", argv[0]);
-           return;
+/////////////////////////////////////////////////
+// JSON lines (-J). Each event is a line of its own, ie
+//	{"ts":1700000000.123456,"board":1,"event":"field","chan":1,"field":"freq","value":146520000}
+// written to a fully buffered stream that's flushed once per loop.
+static void json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+       if (*s == '"' || *s == '\\') {
+          fprintf(fp, "\\%c", *s);
+       } else if ((unsigned char)*s < 0x20) {
+          fprintf(fp, "\\u%04x", *s);
+       } else {
+          fputc(*s, fp);
        }
-       send_command(fd, "AT+AMP+%d", new_amp);
     }
-    send_command(fd, "AT+AMP");
+    fputc('"', fp);
 }
 
-void c_quit(int fd, char *argv[], int argc) {
-   printf("Goodbye!\n");
-   exit(0);
+static void json_begin(const char *event) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fprintf(json_out, "{\"ts\":%lld.%06ld,\"board\":%d,\"event\":\"%s\"", (long long)ts.tv_sec, ts.tv_nsec / 1000,
+            (int)(brd - boards) + 1, event);
 }
 
-void c_ref(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int refclk = convert_to_hertz(argv[0]);
-       printf("* Setting refclk to %d Hz\n", refclk);
-       send_command(fd, "AT+REF+%d", refclk);
+// A command went wrong: error, timeout or an answer we don't understand
+void json_event(const char *event, const char *cmd_line, const char *reply) {
+    json_begin(event);
+    if (cmd_line) {
+       fprintf(json_out, ",\"cmd\":");
+       json_string(json_out, cmd_line);
+    }
+    if (reply) {
+       fprintf(json_out, ",\"reply\":");
+       json_string(json_out, reply);
     }
-    send_command(fd, "AT+REF");
+    fprintf(json_out, "}\n");
 }
 
-void c_reset(int fd, char *argv[], int argc) {
-    printf("* Resetting board. Goodbye!\n");
-    send_command(fd, "AT+RESET");
-    exit(0);
-}
+double field_value(int chan, int f);
 
-void c_restore(int fd, char *argv[], int argc) {
-    if (strcasecmp(argv[0], "CONFIRM") != 0) {
-       printf("Please add CONFIRM to the command line, if sure!\n");
-       return;
+void json_field(int chan, int f) {
+    struct ChannelState *cs = &brd->chan_state[chan-1];
+
+    json_begin("field");
+    if (f < F_CHAN) {
+       fprintf(json_out, ",\"chan\":%d", chan);
+    }
+    fprintf(json_out, ",\"field\":\"%s\",\"value\":", fields[f].name);
+    switch (f) {
+       case F_MODE:
+          json_string(json_out, cs->mode);
+          break;
+       case F_VERSION:
+          json_string(json_out, brd->ver);
+          break;
+       case F_SWEEP:
+          fprintf(json_out, "%s", (cs->sweep_active ? "true" : "false"));
+          break;
+       case F_CHAN:
+          fprintf(json_out, "%d", chan);
+          break;
+       case F_PHASE:
+          fprintf(json_out, "%d,\"deg\":%.2f", cs->phase, convertPhaseToAngle(cs->phase));
+          break;
+       case F_POWER: case F_START_POWER: case F_END_POWER:
+          fprintf(json_out, "%.0f,\"pct\":%.1f", field_value(chan, f), convertAmplitudeToPower(field_value(chan, f)));
+          break;
+       default:
+          fprintf(json_out, "%.0f", field_value(chan, f));
     }
-    printf("* Sending factory reset to board. Goodbye!\n");
-    send_command(fd, "AT+RESTORE");
-    exit(0);
+    fprintf(json_out, "}\n");
 }
 
-void c_save(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      save_config(argv[0]);
-   } else {
-      printf("*** You must specify a file to SAVE to!\n");
-   }
-}
+// Print a mirrored value the same way a reply to it would be shown
+void show_field(int chan, int f) {
+    struct ChannelState *cs = &brd->chan_state[chan-1];
 
-void c_sleep(int fd, char *argv[], int argc) {
-   int sleepms = atoi(argv[0]);
-   // limit to 1ms to 60 seconds
-   if (sleepms <= 0 || sleepms > 60000) {
-      printf("invalid sleep time %s limit [0-60000] ms\n", argv[0]);
-      return;
-   }
+    if (json_out) {
+       json_field(chan, f);
+    }
 
-   printf("Sleep %d ms\n", sleepms);
-   fflush(stdout);
-   usleep(sleepms * 1000);
+    switch (f) {
+       case F_MODE:
+          out_printf("%s- Chan %d mode: %s\n", board_tag(), chan, cs->mode);
+          break;
+       case F_FREQ:
+          out_printf("%s- Chan %d freq: %.0f\n", board_tag(), chan, cs->freq);
+          break;
+       case F_PHASE:
+          out_printf("%s- Chan %d phase: %d (%.1f deg)\n", board_tag(), chan, cs->phase, convertPhaseToAngle(cs->phase));
+          break;
+       case F_POWER:
+          out_printf("%s- Chan %d power: %d (%.1f%%)\n", board_tag(), chan, cs->power, convertAmplitudeToPower(cs->power));
+          break;
+       case F_START_FREQ:
+          out_printf("%s- Chan %d sweep start freq: %.0f\n", board_tag(), chan, cs->sweep_start_freq);
+          break;
+       case F_END_FREQ:
+          out_printf("%s- Chan %d sweep end freq: %.0f\n", board_tag(), chan, cs->sweep_end_freq);
+          break;
+       case F_START_POWER:
+          out_printf("%s- Chan %d SWEEP Start Power: %d (%.1f%%)\n", board_tag(), chan, cs->sweep_start_power, convertAmplitudeToPower(cs->sweep_start_power));
+          break;
+       case F_END_POWER:
+          out_printf("%s- Chan %d SWEEP End Power: %d (%.1f%%)\n", board_tag(), chan, cs->sweep_end_power, convertAmplitudeToPower(cs->sweep_end_power));
+          break;
+       case F_STEP:
+          out_printf("%s- Chan %d sweep step: %.0f\n", board_tag(), chan, cs->sweep_step);
+          break;
+       case F_TIME:
+          out_printf("%s- Chan %d sweep time: %d\n", board_tag(), chan, cs->sweep_time);
+          break;
+       case F_SWEEP:
+          out_printf("%s- Chan %d sweep %s\n", board_tag(), chan, (cs->sweep_active ? "ACTIVE" : "inactive"));
+          break;
+       case F_CHAN:
+          out_printf("%s* Chan %d selected\n", board_tag(), chan);
+          break;
+       case F_REF:
+          out_printf("%s* ClkRef: %d Hz\n", board_tag(), brd->ref_clk);
+          break;
+       case F_MULT:
+          out_printf("%s* Multiplier: %d\n", board_tag(), brd->clk_mult);
+          break;
+       case F_VERSION:
+          out_printf("%s* Connected to board version %s\n", board_tag(), brd->ver);
+          break;
+    }
 }
 
-void c_startfreq(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      double new_freq = convert_to_hertz(argv[0]);
+const char *mode_names[] = { "POINT", "SWEEP", "FSK2", "FSK4", "AM" };
+#define	NUM_MODES	(int)(sizeof(mode_names) / sizeof(mode_names[0]))
 
-      if (new_freq < 1 || new_freq > MAX_FREQ) {
-         printf("*** Invalid argument to startfreq: Value %f out of bounds [1-200,000,000]\n", new_freq);
-         return;
-      }
-      send_command(fd, "AT+STARTFRE+%d", new_freq);
-   }
-   send_command(fd, "AT+STARTFRE");
-}
+// The mirrored value of f in the units we send it in (MODE is an index
+// into mode_names[], -1 if unknown)
+double field_value(int chan, int f) {
+    struct ChannelState *cs = &brd->chan_state[chan-1];
 
-void c_startpower(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      int new_amp = atoi(argv[0]);
-      if (new_amp < 0 || new_amp > 1023) {
-         printf("*** Invalid argument to startpower: Value %d out of bounds [0-1023]\n", new_amp);
-         return;
-      }
-      send_command(fd, "AT+STARTAMP+%d", new_amp);
-   }
-   send_command(fd, "AT+STARTAMP");
+    switch (f) {
+       case F_MODE:
+          for (int i = 0; i < NUM_MODES; i++) {
+             if (strcasecmp(cs->mode, mode_names[i]) == 0) {
+                return i;
+             }
+          }
+          return -1;
+       case F_FREQ:		return cs->freq;
+       case F_PHASE:		return cs->phase;
+       case F_POWER:		return cs->power;
+       case F_START_FREQ:	return cs->sweep_start_freq;
+       case F_END_FREQ:	return cs->sweep_end_freq;
+       case F_START_POWER:	return cs->sweep_start_power;
+       case F_END_POWER:	return cs->sweep_end_power;
+       case F_STEP:		return cs->sweep_step;
+       case F_TIME:		return cs->sweep_time;
+       case F_SWEEP:		return cs->sweep_active;
+       case F_CHAN:		return brd->curr_chan;
+       case F_REF:		return brd->ref_clk;
+       case F_MULT:		return brd->clk_mult;
+    }
+    return -1;
 }
 
-void c_step(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int new_step = convert_to_hertz(argv[0]);
-       if (new_step < MIN_FREQ || new_step > MAX_FREQ) {
-          printf("*** Invalid argument to step: Value %d out of bounds[1-200,000,000]\n", new_step);
-          return;
+// Called before sending a set: if the board already confirmed this exact
+// value, show it and return 1 so the set (and its readback) is skipped.
+// Otherwise the field is unknown until the readback comes in.
+int cache_skip_set(int f, int same) {
+    struct field_meta *m = field_meta(brd->curr_chan, f);
+
+    if (cache_ttl > 0 && !force_query && same && m->confirmed != 0 && !m->dirty) {
+       if (debug) {
+          out_printf("cache: chan %d %s unchanged, not sending\n", brd->curr_chan, fields[f].name);
        }
-       send_command(fd, "AT+STEP+%d", new_step);
+       cache_skips++;
+       show_field(brd->curr_chan, f);
+       return 1;
     }
-   send_command(fd, "AT+STEP");
+    m->dirty = 1;
+    return 0;
 }
 
-void c_sweep(int fd, char *argv[], int argc) {
-   if (argc > 0) {
-      int new_state;
-      if (strncasecmp(argv[0], "OFF", 3) == 0) {
-         new_state = 0;
-      } else if (strncasecmp(argv[0], "ON", 2) == 0) {
-         new_state = 1;
-      } else {
-         printf("*** Invalid argument %s to SWEEP\n", argv[0]);
-      }
-      if (chan_state[curr_chan-1].sweep_active != new_state) {
-         if (debug) {
-            printf("- Chan %d %sabling SWEEP\n", curr_chan, (new_state ? "en" : "dis"));
-         }
-         chan_state[curr_chan-1].sweep_active = new_state;
-      }
-      send_command(fd, "AT+SWEEP+%s", (new_state ? "ON" : "OFF"));
-   }
-   send_command(fd, "AT+SWEEP");
+// Called before sending a query: answer it from the mirror if it's fresh
+int cache_show(int f) {
+    if (cache_ttl <= 0 || force_query || !field_fresh(brd->curr_chan, f)) {
+       return 0;
+    }
+    cache_hits++;
+    show_field(brd->curr_chan, f);
+    return 1;
 }
 
-void c_time(int fd, char *argv[], int argc) {
-    if (argc > 0) {
-       int new_time = atoi(argv[0]);
-       if (new_time < 1 || new_time > 9999) {
-          printf("*** Invalid argument to time: Value %d out of bounds[1-9999]\n", new_time);
-          return;
-       }
-       send_command(fd, "AT+TIME+%d", new_time);
+void send_command(int fd, const char *format, ...);
+
+// Ask the board for f. After a set this is the readback, which the 'never'
+// refresh policy skips (the set's OK confirms the value instead).
+void query_field(int fd, int f, int readback) {
+    if (readback && refresh_policy == REFRESH_NEVER && !force_query) {
+       return;
     }
-    send_command(fd, "AT+TIME");
+    send_command(fd, "AT+%s", fields[f].key);
+}
+
+// Query the fields of chan that matter in its current mode, if they're
+// unknown, stale or dirty and not already on their way
+void chan_refresh_fields(int fd, int chan) {
+    struct ChannelState *cs = &brd->chan_state[chan-1];
+    int first, last;
+
+    // the board only answers for the selected channel
+    if (chan != brd->curr_chan) {
+       return;
+    }
+
+    if (strcasecmp(cs->mode, "POINT") == 0) {
+       first = F_FREQ;
+       last = F_POWER;
+    } else if (strcasecmp(cs->mode, "SWEEP") == 0) {
+       first = F_START_FREQ;
+       last = F_SWEEP;
+    } else {
+       return;
+    }
+
+    for (int f = first; f <= last; f++) {
+       if (!cs->meta[f].pending && !field_fresh(chan, f)) {
+          query_field(fd, f, 0);
+       }
+    }
+}
+
+// Bring our picture of chan up to date. The mode decides which other
+// fields matter, so if we need it the rest waits for its reply.
+void chan_refresh(int fd, int chan) {
+    struct ChannelState *cs = &brd->chan_state[chan-1];
+
+    if (chan != brd->curr_chan) {
+       return;
+    }
+
+    if (cs->meta[F_MODE].pending) {
+       return;
+    } else if (!field_fresh(chan, F_MODE)) {
+       query_field(fd, F_MODE, 0);
+       return;
+    }
+    chan_refresh_fields(fd, chan);
+}
+
+static int lat_bucket(int64_t usec) {
+    if (usec < 4) {
+       return (usec < 0 ? 0 : usec);
+    }
+    int octave = 63 - __builtin_clzll(usec);
+    int bucket = 4 + (octave - 2) * 4 + ((usec >> (octave - 2)) & 3);
+    return (bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1);
+}
+
+// upper edge of a bucket, usec
+static int64_t lat_bucket_top(int bucket) {
+    if (bucket < 4) {
+       return bucket + 1;
+    }
+    int octave = (bucket - 4) / 4 + 2;
+    return (int64_t)(4 + (bucket - 4) % 4 + 1) << (octave - 2);
+}
+
+static struct lat_stats *cmd_lat(const struct at_cmd *cmd) {
+    return &brd->cmd_stats[(cmd->field >= 0 ? cmd->field : F_MAX)][cmd->query];
+}
+
+// A command finished (or failed) after usec
+void lat_record(struct lat_stats *ls, int64_t usec) {
+    ls->count++;
+    ls->sum += usec;
+    if (usec > ls->max) {
+       ls->max = usec;
+    }
+    ls->hist[lat_bucket(usec)]++;
+}
+
+// Latency at quantile q (0-1), usec
+int64_t lat_quantile(const struct lat_stats *ls, double q) {
+    unsigned long want = (unsigned long)ceil(q * ls->count), seen = 0;
+
+    if (ls->count == 0) {
+       return 0;
+    }
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+       seen += ls->hist[i];
+       if (seen >= want && seen > 0) {
+          int64_t top = lat_bucket_top(i);
+          return (top < ls->max ? top : ls->max);
+       }
+    }
+    return ls->max;
+}
+
+static int cmdq_waiting(void) {
+    return (brd->cmdq.head - brd->cmdq.tail) - brd->cmdq.inflight;
+}
+
+// (Re)arm the timeout timer for the oldest in-flight command
+static void cmdq_arm(void) {
+    if (loop == NULL) {
+       return;
+    }
+    ev_timer_stop(loop, &brd->cmdq_timer);
+
+    if (brd->cmdq.inflight > 0) {
+       struct at_cmd *cmd = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+       double after = (cmd->deadline - mono_usec()) / 1000000.0;
+
+       ev_timer_set(&brd->cmdq_timer, (after > 0 ? after : 0), 0.);
+       ev_timer_start(loop, &brd->cmdq_timer);
+    }
+}
+
+// Flight recorder: every line written to or read from a board, with when,
+// goes into a fixed ring (oldest overwritten). Recording's a copy into a
+// slot, nothing's formatted or written until it's dumped.
+struct trace_frame {
+    int64_t usec;		// mono_usec()
+    uint8_t dir;		// 0 = to the board, 1 = from it
+    uint8_t board;		// index into boards[]
+    uint8_t len;
+    char data[53];		// not NUL terminated, long lines are cut short
+};
+
+struct trace_ring {
+    struct trace_frame frames[TRACE_SIZE];
+    unsigned long head;		// frames ever recorded
+} trace;
+
+static void trace_record(int dir, const char *line, size_t len, int64_t usec) {
+    struct trace_frame *t = &trace.frames[trace.head++ & (TRACE_SIZE - 1)];
+
+    if (len > sizeof(t->data)) {
+       len = sizeof(t->data);
+    }
+    t->usec = usec;
+    t->dir = dir;
+    t->board = brd - boards;
+    t->len = len;
+    memcpy(t->data, line, len);
+}
+
+// Write out everything batched up so far in a single writev()
+void tx_flush(int fd) {
+    static const char crlf[] = "\r\n";
+    struct iovec iov[TX_MAX_BATCH * 2];
+    struct iovec *iop = iov;
+    int iovcnt = 0;
+    size_t total = 0;
+
+    if (brd->tx.count == 0) {
+       return;
+    }
+
+    for (int i = 0; i < brd->tx.count; i++) {
+       iov[iovcnt].iov_base = brd->tx.cmds[i]->line;
+       iov[iovcnt].iov_len = strlen(brd->tx.cmds[i]->line);
+       total += iov[iovcnt++].iov_len;
+       iov[iovcnt].iov_base = (void *)crlf;
+       iov[iovcnt].iov_len = 2;
+       total += iov[iovcnt++].iov_len;
+    }
+
+    // the port's blocking, but pick up after short writes or signals anyway
+    while (iovcnt > 0) {
+       ssize_t nbytes = writev(fd, iop, iovcnt);
+
+       if (nbytes < 0) {
+          if (errno == EINTR) {
+             continue;
+          }
+          int my_errno = errno;
+          out_printf("*** Error writing serial port: %d:%s\n", my_errno, strerror(my_errno));
+          exit(EXIT_FAILURE);
+       }
+       while (iovcnt > 0 && (size_t)nbytes >= iop->iov_len) {
+          nbytes -= iop->iov_len;
+          iop++;
+          iovcnt--;
+       }
+       if (iovcnt > 0) {
+          iop->iov_base = (char *)iop->iov_base + nbytes;
+          iop->iov_len -= nbytes;
+       }
+    }
+
+    // reply deadlines run from when the command actually went out
+    int64_t now = mono_usec();
+    for (int i = 0; i < brd->tx.count; i++) {
+       trace_record(0, brd->tx.cmds[i]->line, strlen(brd->tx.cmds[i]->line), now);
+       brd->tx.cmds[i]->sent = now;
+       brd->tx.cmds[i]->deadline = now + (int64_t)brd->cmdq.timeout * 1000;
+    }
+
+    int bucket = 0;
+    while (bucket < 6 && brd->tx.count > (1 << bucket)) {
+       bucket++;
+    }
+    brd->tx.hist[bucket]++;
+    brd->tx.flushes++;
+    brd->tx.frames += brd->tx.count;
+    brd->tx.bytes += total;
+    if ((unsigned long)brd->tx.count > brd->tx.max_batch) {
+       brd->tx.max_batch = brd->tx.count;
+    }
+    brd->tx.count = 0;
+    cmdq_arm();
+}
+
+// Write out waiting commands while there's room in the window
+void cmdq_kick(int fd) {
+    while (cmdq_waiting() > 0 && brd->cmdq.inflight < (unsigned)brd->cmdq.window) {
+        struct at_cmd *cmd = &brd->cmdq.cmds[(brd->cmdq.tail + brd->cmdq.inflight) & (CMDQ_SIZE - 1)];
+
+        if (debug) {
+           out_printf("ser_send: %s\n", cmd->line);
+        }
+
+        // replayed, it went out when the trace was made
+        if (cmd->flags & CMD_REPLAY) {
+           cmd->sent = mono_usec();
+           cmd->deadline = cmd->sent + (int64_t)brd->cmdq.timeout * 1000;
+           brd->cmdq.inflight++;
+           continue;
+        }
+
+        // goes out with the rest of this loop iteration's commands. Slots are
+        // only reused after CMDQ_SIZE more commands, so cmd stays valid until then.
+        if (brd->tx.count >= TX_MAX_BATCH) {
+           tx_flush(fd);
+        }
+        brd->tx.cmds[brd->tx.count++] = cmd;
+        cmd->sent = mono_usec();
+        cmd->deadline = cmd->sent + (int64_t)brd->cmdq.timeout * 1000;
+
+        // nothing will come back, so it's done as soon as it's gone
+        if ((cmd->flags & CMD_NOREPLY) && brd->cmdq.inflight == 0) {
+           struct client *c = (cmd->client ? client_by_id(cmd->client) : NULL);
+           if (c != NULL) {
+              c->pending--;
+           }
+           brd->cmdq.tail++;
+           brd->cmdq.completed++;
+           continue;
+        }
+        brd->cmdq.inflight++;
+    }
+    cmdq_arm();
+}
+
+void hop_done(int fd, int64_t sent);
+void cal_reply(int fd, const struct at_cmd *cmd, const char *line);
+void snapshot_check(int fd);
+void snapshot_save(struct board *b);
+
+// Drop the oldest in-flight command and let the next one go
+static void cmdq_retire(int fd) {
+    struct at_cmd *cmd = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+    int flags = cmd->flags;
+    int64_t sent = cmd->sent;
+    struct client *c = (cmd->client ? client_by_id(cmd->client) : NULL);
+
+    if (c != NULL) {
+       c->pending--;
+    }
+
+    // answered, failed or timed out, either way it's not pending any more
+    if (cmd->query && cmd->field >= 0) {
+       field_meta(cmd->chan, cmd->field)->pending = 0;
+    }
+    brd->cmdq.tail++;
+    brd->cmdq.inflight--;
+
+    // NOREPLY commands that were waiting behind it are finished too
+    while (brd->cmdq.inflight > 0 && (brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)].flags & CMD_NOREPLY)) {
+       struct at_cmd *nr = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+       if (nr->client && (c = client_by_id(nr->client)) != NULL) {
+          c->pending--;
+       }
+       brd->cmdq.tail++;
+       brd->cmdq.inflight--;
+       brd->cmdq.completed++;
+    }
+    cmdq_kick(fd);
+
+    if (flags & CMD_HOP_END) {
+       hop_done(fd, sent);
+    }
+
+}
+
+// The board timed out or didn't understand a command sent at sent: halve the window
+static void pace_backoff(int64_t sent, const char *why) {
+    brd->pace.clean = 0;
+    if (brd->pace.calibrating || brd->replaying || brd->cmdq.window <= 1 || sent <= brd->pace.backed_off) {
+       return;
+    }
+    brd->cmdq.window /= 2;
+    brd->pace.backoffs++;
+    brd->pace.backed_off = mono_usec();
+    out_printf("%s* Window backed off to %d (%s)\n", board_tag(), brd->cmdq.window, why);
+}
+
+// A clean reply, open the window back up once there's been enough of them
+static void pace_ok(void) {
+    if (brd->cmdq.window >= brd->pace.ceiling || ++brd->pace.clean < PACE_RECOVER) {
+       return;
+    }
+    brd->pace.clean = 0;
+    brd->cmdq.window++;
+    if (debug) {
+       out_printf("%space: window up to %d\n", board_tag(), brd->cmdq.window);
+    }
+}
+
+// Match a reply line against the oldest in-flight command. Returns the
+// command it completed (valid until the next reply) or NULL.
+struct at_cmd *cmdq_reply(int fd, const char *line) {
+    static struct at_cmd done;
+    struct at_cmd *cmd;
+
+    if (brd->cmdq.inflight == 0) {
+       brd->cmdq.stray++;
+       return NULL;
+    }
+    cmd = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+
+    if (strncmp(line, "ERROR", 5) == 0) {
+       struct client *c = (cmd->client ? client_by_id(cmd->client) : NULL);
+       if (c != NULL) {
+          c->errors++;
+       }
+       brd->cmdq.errors++;
+       cmd_lat(cmd)->errors++;
+       // out of range is our fault, anything else means the command got mangled
+       if (strcmp(line, "ERROR_DATA_OVER_RANGEM") != 0) {
+          pace_backoff(cmd->sent, line);
+       }
+    } else if (strncmp(line, "OK", 2) == 0) {
+       if (cmd->query) {
+          // queries are finished by their +KEY= line, not by OK
+          brd->cmdq.stray++;
+          return NULL;
+       }
+    } else if (line[0] == '+') {
+       size_t klen = strlen(cmd->key);
+
+       if (!cmd->query || strncmp(line + 1, cmd->key, klen) != 0 || line[klen + 1] != '=') {
+          // unsolicited status, not the reply we're waiting for
+          brd->cmdq.stray++;
+          return NULL;
+       }
+    } else {
+       brd->cmdq.stray++;
+       return NULL;
+    }
+
+    if (line[0] != 'E') {
+       pace_ok();
+    }
+    int64_t usec = mono_usec() - cmd->sent;
+    lat_record(cmd_lat(cmd), usec);
+    if (debug > 1) {
+       out_printf("cmdq: %s completed in %.1f ms\n", cmd->line, usec / 1000.0);
+    }
+    done = *cmd;
+    brd->cmdq.completed++;
+    cmdq_retire(fd);
+    return &done;
+}
+
+// Expire the oldest in-flight command(s) if the board hasn't answered
+void cmdq_check_timeouts(int fd) {
+    int64_t now = mono_usec();
+
+    while (brd->cmdq.inflight > 0) {
+       struct at_cmd *cmd = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+
+       if (now < cmd->deadline) {
+          break;
+       }
+       // tell whoever sent it (calibration counts its own)
+       client_enter(cmd->client ? client_by_id(cmd->client) : NULL);
+       if (!(cmd->flags & CMD_CAL)) {
+          out_printf("%s*** Timeout waiting for reply to %s (%d ms)\n", board_tag(), cmd->line, brd->cmdq.timeout);
+          if (json_out) {
+             json_event("timeout", cmd->line, NULL);
+          }
+       }
+       if (cur_client) {
+          cur_client->timeouts++;
+       }
+       brd->cmdq.timeouts++;
+       cmd_lat(cmd)->timeouts++;
+       pace_backoff(cmd->sent, "timeout");
+       int flags = cmd->flags;
+       struct at_cmd expired = *cmd;
+       cmdq_retire(fd);
+       if (flags & CMD_CAL) {
+          cal_reply(fd, &expired, NULL);
+       }
+       client_enter(NULL);
+       if (flags & CMD_PROBE_END) {
+          snapshot_check(fd);
+       }
+    }
+}
+
+// Is every board done with everything we've sent it?
+int boards_idle(void) {
+    for (int i = 0; i < num_boards; i++) {
+       if (boards[i].cmdq.head != boards[i].cmdq.tail) {
+          return 0;
+       }
+    }
+    return 1;
+}
+
+// Write out whatever's batched up for every board
+void boards_flush(void) {
+    struct board *was = brd;
+
+    for (int i = 0; i < num_boards; i++) {
+       brd = &boards[i];
+       tx_flush(brd->fd);
+    }
+    brd = was;
+}
+
+// Most commands any board has waiting to go out
+int boards_backlog(void) {
+    struct board *was = brd;
+    int most = 0;
+
+    for (int i = 0; i < num_boards; i++) {
+       brd = &boards[i];
+       if (cmdq_waiting() > most) {
+          most = cmdq_waiting();
+       }
+    }
+    brd = was;
+    return most;
+}
+
+// boardN, or NULL if name isn't one
+struct board *board_by_name(const char *name) {
+    char *end;
+    long n;
+
+    if (strncasecmp(name, "board", 5) != 0 || !isdigit((unsigned char)name[5])) {
+       return NULL;
+    }
+    n = strtol(name + 5, &end, 10);
+    if (*end != '\0' || n < 1 || n > num_boards) {
+       return NULL;
+    }
+    return &boards[n - 1];
+}
+
+// Everything's answered, say goodbye and go. -x exits 1 if the board
+// rejected or never answered any of it.
+void quit_now(void) {
+    int status = 0;
+
+    boards_flush();
+    if (!exec_mode) {
+       out_printf("%s\n", quit_msg);
+    }
+    for (int i = 0; i < num_boards; i++) {
+       snapshot_save(&boards[i]);
+       if (exec_mode && (boards[i].cmdq.errors || boards[i].cmdq.timeouts)) {
+          status = 1;
+       }
+    }
+    exit(status);
+}
+
+void key_stop(void);
+int daemon_mode(void);
+
+// Stop taking input and exit once everything queued has been answered (or timed out)
+void quit_when_idle(const char *msg) {
+    quit_msg = msg;
+    key_stop();
+    ev_io_stop(loop, &stdin_watcher);
+    for (int i = 0; i < 2; i++) {
+       if (listen_fds[i] >= 0) {
+          ev_io_stop(loop, &listen_watchers[i]);
+       }
+    }
+
+    if (boards_idle()) {
+       quit_now();
+    }
+}
+
+// SIGINT/SIGTERM: finish what's in flight (key up, snapshot saved, socket
+// cleaned up) and go. Asked again, don't wait for a board that's gone quiet.
+static void quit_signal_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+    if (quit_msg) {
+       quit_now();
+    }
+    quit_when_idle(daemon_mode() ? "Shutting down" : "Goodbye!");
+}
+
+// Queue a ready made command (a copy of it, with extra flags added)
+void cmdq_push(int fd, const struct at_cmd *tmpl, int flags) {
+    struct at_cmd *cmd;
+
+    // what replayed replies set off is already in the trace, as it was sent then
+    if (brd->replaying && !(flags & CMD_REPLAY)) {
+       return;
+    }
+
+    // input is held back long before this, so something's gone badly wrong
+    if ((brd->cmdq.head - brd->cmdq.tail) >= CMDQ_SIZE) {
+       out_printf("*** Command queue full, dropping command!\n");
+       return;
+    }
+
+    cmd = &brd->cmdq.cmds[brd->cmdq.head & (CMDQ_SIZE - 1)];
+    *cmd = *tmpl;
+    cmd->flags |= flags;
+    cmd->client = (cur_client ? cur_client->id : 0);
+    if (cur_client) {
+       cur_client->pending++;
+    }
+
+    if (cmd->query && cmd->field >= 0) {
+       field_meta(cmd->chan, cmd->field)->pending = 1;
+    }
+    brd->cmdq.head++;
+    cmdq_kick(fd);
+}
+
+// Fill in what we need to know about cmd->line to match its reply
+void cmd_prepare(struct at_cmd *cmd) {
+    // AT+KEY is a query, AT+KEY+value is a set
+    if (strncmp(cmd->line, "AT+", 3) == 0) {
+       const char *key = cmd->line + 3;
+       size_t klen = strcspn(key, "+");
+
+       if (klen >= sizeof(cmd->key)) {
+          klen = sizeof(cmd->key) - 1;
+       }
+       memcpy(cmd->key, key, klen);
+       cmd->query = (key[klen] == '\0');
+       cmd->field = field_by_key(key, klen);
+    } else {
+       cmd->field = -1;
+    }
+}
+
+void send_command_flags(int fd, int flags, const char *format, va_list args) {
+    struct at_cmd cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    vsnprintf(cmd.line, sizeof(cmd.line), format, args);
+    cmd.chan = brd->curr_chan;
+    cmd_prepare(&cmd);
+    cmdq_push(fd, &cmd, flags);
+}
+
+void send_command(int fd, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    send_command_flags(fd, 0, format, args);
+    va_end(args);
+}
+
+void send_command_noreply(int fd, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    send_command_flags(fd, CMD_NOREPLY, format, args);
+    va_end(args);
+}
+
+void sleep_start(int ms) {
+   // a client's sleep only holds back that client
+   ev_timer *t = (cur_client ? &cur_client->sleep_timer : &sleep_timer);
+
+   out_printf("Sleep %d ms\n", ms);
+   fflush(msg_out);
+
+   // replies keep being read while we wait, further input is held back until the timer fires
+   ev_now_update(loop);
+   ev_timer_stop(loop, t);
+   ev_timer_set(t, ms / 1000.0, 0.);
+   ev_timer_start(loop, t);
+}
+
+/////////////////////////////////////////////////
+// Scripts (.scl) are parsed once into a list of ops with every argument
+// range checked and converted to what we'll send, so running one is just a
+// walk down the list. Compiled scripts are kept, keyed on path and mtime,
+// so loading an unchanged file again doesn't parse it again.
+enum script_opcode {
+    OP_SET,		// set field to value
+    OP_SLEEP,		// hold off the next op for value ms
+    OP_QUIT,
+    OP_CONSOLE		// anything else, run as a console command from text[]
+};
+
+struct script_op {
+    uint8_t op;
+    uint8_t field;
+    uint32_t text;		// OP_CONSOLE: offset of the command in text[]
+    int line;			// source line, for messages
+    double value;
+};
+
+struct script {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    struct script_op *ops;
+    int nops, ops_sz;
+    char *text;
+    size_t text_len, text_sz;
+    struct script *next;
+};
+
+struct script *script_cache = NULL;
+struct script *script_running = NULL;
+int script_pc = 0;		// next op to run
+
+void handle_command(int fd, const char *input);
+
+void script_free(struct script *s) {
+    free(s->path);
+    free(s->ops);
+    free(s->text);
+    free(s);
+}
+
+struct script_op *script_add_op(struct script *s, int op, int line) {
+    if (s->nops == s->ops_sz) {
+       s->ops_sz = (s->ops_sz ? s->ops_sz * 2 : 64);
+       s->ops = realloc(s->ops, s->ops_sz * sizeof(struct script_op));
+       if (!s->ops) {
+          abort();
+       }
+    }
+    struct script_op *o = &s->ops[s->nops++];
+    memset(o, 0, sizeof(*o));
+    o->op = op;
+    o->line = line;
+    return o;
+}
+
+void script_add_text(struct script *s, struct script_op *o, char *argv[], int argc) {
+    for (int i = 0; i < argc; i++) {
+       size_t len = strlen(argv[i]) + 1;
+
+       while (s->text_len + len + 1 > s->text_sz) {
+          s->text_sz = (s->text_sz ? s->text_sz * 2 : 1024);
+          s->text = realloc(s->text, s->text_sz);
+          if (!s->text) {
+             abort();
+          }
+       }
+       if (i == 0) {
+          o->text = s->text_len;
+       } else {
+          s->text[s->text_len - 1] = ' ';
+       }
+       memcpy(s->text + s->text_len, argv[i], len);
+       s->text_len += len;
+    }
+}
+
+// Check and convert an argument for setting field f. Returns -1 (with a
+// reason in err) if it's no good.
+int script_parse_value(int f, const char *arg, double *value, char *err, size_t errsz) {
+    double v;
+
+    switch (f) {
+       case F_MODE:
+          for (int i = 0; i < NUM_MODES; i++) {
+             if (strcasecmp(arg, mode_names[i]) == 0) {
+                *value = i;
+                return 0;
+             }
+          }
+          snprintf(err, errsz, "Invalid mode %s [POINT|SWEEP|FSK2|FSK4|AM]", arg);
+          return -1;
+       case F_SWEEP:
+          if (strcasecmp(arg, "ON") == 0 || strcasecmp(arg, "OFF") == 0) {
+             *value = (strcasecmp(arg, "ON") == 0);
+             return 0;
+          }
+          snprintf(err, errsz, "Invalid sweep state %s [ON|OFF]", arg);
+          return -1;
+       case F_FREQ: case F_START_FREQ: case F_END_FREQ: case F_STEP:
+          if (parse_hertz(arg, &v) < 0 || round(v) < MIN_FREQ || round(v) > MAX_FREQ) {
+             snprintf(err, errsz, "Invalid frequency %s [1-200,000,000] Hz", arg);
+             return -1;
+          }
+          *value = round(v);
+          return 0;
+       case F_REF:
+          if (parse_hertz(arg, &v) < 0 || v < 10000000 || v > 125000000) {
+             snprintf(err, errsz, "Invalid refclk %s [10,000,000-125,000,000] Hz", arg);
+             return -1;
+          }
+          *value = round(v);
+          return 0;
+       case F_PHASE:
+          if (parse_number(arg, &v) < 0 || v < 0 || v > 360) {
+             snprintf(err, errsz, "Invalid phase %s [0.0-360.0] degrees", arg);
+             return -1;
+          }
+          *value = convertAngleToPhase(v);
+          return 0;
+       case F_POWER: case F_START_POWER: case F_END_POWER: {
+          char buf[32];
+          size_t len = strlen(arg);
+          int percent = (len > 0 && len < sizeof(buf) && arg[len - 1] == '%');
+
+          snprintf(buf, sizeof(buf), "%.*s", (int)(len - percent), arg);
+          if (parse_number(buf, &v) < 0 || (percent && (v < 0 || v > 100)) ||
+              (!percent && (v < 0 || v > 1023 || v != floor(v)))) {
+             snprintf(err, errsz, "Invalid power %s [0-1023] | [0-100%%]", arg);
+             return -1;
+          }
+          *value = (percent ? convertPowerToAmplitude(v) : v);
+          return 0;
+       }
+       case F_TIME:
+       case F_CHAN:
+       case F_MULT: {
+          int lo = 1, hi = (f == F_TIME ? 9999 : (f == F_CHAN ? MAX_CHAN : 20));
+
+          if (parse_number(arg, &v) < 0 || v < lo || v > hi || v != floor(v)) {
+             snprintf(err, errsz, "Invalid %s %s [%d-%d]", fields[f].name, arg, lo, hi);
+             return -1;
+          }
+          *value = v;
+          return 0;
+       }
+    }
+    snprintf(err, errsz, "%s can't be set", fields[f].name);
+    return -1;
+}
+
+// Same for a console command's argument, saying what's wrong with it
+int arg_value(int f, const char *arg, double *value) {
+    char err[128];
+
+    if (script_parse_value(f, arg, value, err, sizeof(err)) < 0) {
+       out_printf("*** %s\n", err);
+       return -1;
+    }
+    return 0;
+}
+
+// name value, if name is a mirrored field. Returns 1 if it was (and it's
+// been added), 0 if it's not a field or -1 if value's no good.
+int script_compile_set(struct script *s, const char *name, const char *arg, int lineno, char *err, size_t errsz) {
+    for (int f = 0; f < F_VERSION; f++) {
+       if (strcasecmp(name, fields[f].name) == 0) {
+          struct script_op *o;
+          double value;
+
+          if (script_parse_value(f, arg, &value, err, errsz) < 0) {
+             return -1;
+          }
+          o = script_add_op(s, OP_SET, lineno);
+          o->field = f;
+          o->value = value;
+          return 1;
+       }
+    }
+    return 0;
+}
+
+// Parse one (comment and whitespace stripped) script line into s.
+// Returns -1 (with a reason in err) if it's no good.
+int script_compile_line(struct script *s, char *line, int lineno, char *err, size_t errsz) {
+    char *argv[MAX_ARGS + 2];
+    int argc = 0;
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t", &save);
+
+    while (tok != NULL && argc < MAX_ARGS + 2) {
+       argv[argc++] = tok;
+       tok = strtok_r(NULL, " \t", &save);
+    }
+    if (argc == 0) {
+       return 0;
+    }
+
+    if (strcasecmp(argv[0], "sleep") == 0) {
+       double ms;
+       if (argc != 2 || parse_number(argv[1], &ms) < 0 || ms < 1 || ms > MAX_SLEEP) {
+          snprintf(err, errsz, "Invalid sleep, need a time [1-%d] ms", MAX_SLEEP);
+          return -1;
+       }
+       script_add_op(s, OP_SLEEP, lineno)->value = ms;
+       return 0;
+    } else if (strcasecmp(argv[0], "quit") == 0) {
+       script_add_op(s, OP_QUIT, lineno);
+       return 0;
+    } else if (strcasecmp(argv[0], "load") == 0) {
+       snprintf(err, errsz, "Scripts can't load other scripts");
+       return -1;
+    }
+
+    // boardN and chan N in front are sorted out when it runs, check the command after them
+    int skip = 0;
+    if (strncasecmp(argv[0], "board", 5) == 0 && isdigit((unsigned char)argv[0][5])) {
+       skip = 1;
+    }
+    if (argc > skip + 2 && strcasecmp(argv[skip], "chan") == 0 && cmd_by_name(argv[skip + 2]) != NULL) {
+       skip += 2;
+    }
+
+    // setting a mirrored field: check and convert it now
+    if (argc == 2 && skip == 0) {
+       int r = script_compile_set(s, argv[0], argv[1], lineno, err, errsz);
+       if (r != 0) {
+          return (r < 0 ? -1 : 0);
+       }
+    }
+
+    // chan N field value is two sets, so script_batch() can see them
+    if (argc == 4 && skip == 2) {
+       int nops = s->nops;
+       int r = script_compile_set(s, argv[0], argv[1], lineno, err, errsz);
+
+       if (r > 0 && (r = script_compile_set(s, argv[2], argv[3], lineno, err, errsz)) > 0) {
+          return 0;
+       }
+       s->nops = nops;
+       if (r < 0) {
+          return -1;
+       }
+    }
+
+    // anything else has to at least be a command we know
+    if (skip >= argc) {
+       script_add_text(s, script_add_op(s, OP_CONSOLE, lineno), argv, argc);
+       return 0;
+    }
+    struct cmds *c = cmd_by_name(argv[skip]);
+    if (c == NULL) {
+       snprintf(err, errsz, "Unknown command: %s", argv[skip]);
+       return -1;
+    }
+
+    int nargs = argc - skip - 1;
+    if (nargs > 0 && strcasecmp(argv[argc - 1], "force") == 0) {
+       nargs--;
+    }
+    if (nargs < c->min_args || nargs > c->max_args) {
+       snprintf(err, errsz, "Usage: %s %s", c->name, c->msg);
+       return -1;
+    }
+    script_add_text(s, script_add_op(s, OP_CONSOLE, lineno), argv, argc);
+    return 0;
+}
+
+// Batching: a run of channel and per channel sets (anything else, like a
+// sleep, console command, ref or mult, ends the run and stays where it is)
+// is regrouped by channel. Within a channel a set only survives if nothing
+// later in the run sets the same field, and moves to where that last set
+// was. A mode set isn't crossed, since changing mode resets the rest. The
+// channels are then sent in turn: whatever was selected when the run began
+// first (no switch), the one it leaves selected last, each selected once.
+static int batch_op(const struct script_op *o) {
+    return (o->op == OP_SET && o->field <= F_CHAN);
+}
+
+void script_batch(struct script *s) {
+    struct script_op *out = malloc((s->nops + 1) * sizeof(struct script_op));
+    struct script_op *group[MAX_CHAN + 1];	// [0] is the channel selected when the run starts
+    int glen[MAX_CHAN + 1], gline[MAX_CHAN + 1];
+    int nout = 0;
+
+    if (out == NULL || (group[0] = malloc((MAX_CHAN + 1) * (s->nops + 1) * sizeof(struct script_op))) == NULL) {
+       abort();
+    }
+    for (int c = 1; c <= MAX_CHAN; c++) {
+       group[c] = group[0] + c * (s->nops + 1);
+    }
+
+    for (int i = 0; i < s->nops; ) {
+       if (!batch_op(&s->ops[i])) {
+          out[nout++] = s->ops[i++];
+          continue;
+       }
+
+       int order[MAX_CHAN], norder = 0, chan = 0, last_chan = 0;
+       memset(glen, 0, sizeof(glen));
+
+       for (; i < s->nops && batch_op(&s->ops[i]); i++) {
+          struct script_op *o = &s->ops[i];
+          struct script_op *g;
+          int n, k;
+
+          if (o->field == F_CHAN) {
+             chan = last_chan = o->value;
+             gline[chan] = o->line;
+             for (k = 0; k < norder && order[k] != chan; k++) {
+             }
+             if (k == norder) {
+                order[norder++] = chan;
+             }
+             continue;
+          }
+
+          // drop an earlier set of the same field, back as far as the last mode change
+          g = group[chan];
+          n = glen[chan];
+          for (k = n - 1; k >= 0 && g[k].field != F_MODE; k--) {
+             if (g[k].field == o->field) {
+                memmove(&g[k], &g[k + 1], (n - k - 1) * sizeof(*g));
+                n--;
+                break;
+             }
+          }
+          if (o->field == F_MODE && n > 0 && g[n - 1].field == F_MODE) {
+             n--;
+          }
+          g[n++] = *o;
+          glen[chan] = n;
+       }
+
+       // the channel that was already selected, the others, then the one we end up on
+       for (int k = 0; k < glen[0]; k++) {
+          out[nout++] = group[0][k];
+       }
+       for (int pass = 0; pass < 2; pass++) {
+          for (int k = 0; k < norder; k++) {
+             int c = order[k];
+
+             if ((pass == 0) == (c == last_chan) || (glen[c] == 0 && c != last_chan)) {
+                continue;
+             }
+             out[nout].op = OP_SET;
+             out[nout].field = F_CHAN;
+             out[nout].text = 0;
+             out[nout].line = gline[c];
+             out[nout++].value = c;
+             for (int j = 0; j < glen[c]; j++) {
+                out[nout++] = group[c][j];
+             }
+          }
+       }
+    }
+
+    if (debug && nout != s->nops) {
+       out_printf("script: %s: %d ops batched down to %d\n", s->path, s->nops, nout);
+    }
+    free(group[0]);
+    free(s->ops);
+    s->ops = out;
+    s->nops = nout;
+    s->ops_sz = s->nops + 1;
+}
+
+// Parse a whole script, reporting every bad line. Returns NULL if there were any.
+struct script *script_compile(const char *path, struct stat *st) {
+    FILE *fp = fopen(path, "r");
+    char line[BUFFER_SIZE];
+    int lineno = 0, errors = 0;
+
+    if (fp == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error opening script %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       return NULL;
+    }
+
+    struct script *s = calloc(1, sizeof(struct script));
+    if (!s || !(s->path = strdup(path))) {
+       abort();
+    }
+    s->mtime = st->st_mtim;
+    s->size = st->st_size;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+       char err[128];
+       int len = strlen(line);
+
+       lineno++;
+       if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+          out_printf("*** %s:%d: Line too long (max %d)\n", path, lineno, (int)sizeof(line) - 2);
+          errors++;
+          // skip the rest of it
+          while (fgets(line, sizeof(line), fp) != NULL && line[strlen(line) - 1] != '\n') {
+          }
+          continue;
+       }
+
+       // Remove trailing whitespace (and line endings)
+       while (len > 0 && isspace((unsigned char)line[len - 1])) {
+           line[--len] = '\0';
+       }
+
+       // Skip leading whitespace
+       char *cmd_start = line;
+       while (isspace((unsigned char)*cmd_start)) {
+           cmd_start++;
+       }
+
+       // skip single-line comments (we don't support multi-line)
+       if (cmd_start[0] == '#' || cmd_start[0] == ';' || (cmd_start[0] == '/' && cmd_start[1] == '/')) {
+          continue;
+       }
+
+       if (script_compile_line(s, cmd_start, lineno, err, sizeof(err)) < 0) {
+          out_printf("*** %s:%d: %s\n", path, lineno, err);
+          errors++;
+       }
+    }
+    fclose(fp);
+
+    if (errors) {
+       out_printf("*** %s: %d error%s, not loaded\n", path, errors, (errors == 1 ? "" : "s"));
+       script_free(s);
+       return NULL;
+    }
+    script_batch(s);
+    return s;
+}
+
+// Find path's compiled form, (re)compiling it if we don't have it or the file changed
+struct script *script_load(const char *path) {
+    struct script **sp, *s;
+    struct stat st;
+
+    if (stat(path, &st) < 0) {
+       int my_errno = errno;
+       out_printf("*** Error opening script %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       return NULL;
+    }
+
+    for (sp = &script_cache; (s = *sp) != NULL; sp = &s->next) {
+       if (strcmp(s->path, path) == 0) {
+          if (s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+              s->size == st.st_size) {
+             if (debug) {
+                out_printf("script: %s unchanged, using compiled copy\n", path);
+             }
+             return s;
+          }
+
+          // stale, unless it's still running
+          if (s == script_running) {
+             out_printf("*** Script %s changed while running\n", path);
+             return NULL;
+          }
+          *sp = s->next;
+          script_free(s);
+          break;
+       }
+    }
+
+    int64_t start = mono_usec();
+    if ((s = script_compile(path, &st)) == NULL) {
+       return NULL;
+    }
+    if (debug) {
+       out_printf("script: compiled %s to %d ops in %.1f ms\n", path, s->nops, (mono_usec() - start) / 1000.0);
+    }
+    s->next = script_cache;
+    script_cache = s;
+    return s;
+}
+
+void script_start(struct script *s) {
+    if (script_running) {
+       out_printf("*** Already running script %s\n", script_running->path);
+       return;
+    }
+    if (!exec_mode) {
+       out_printf("* Running script %s (%d commands)\n", s->path, s->nops);
+    }
+    script_running = s;
+    script_pc = 0;
+}
+
+// Set a field from a script, the way the matching console command would
+void script_set(int fd, int f, double value) {
+    if (cache_skip_set(f, field_value(brd->curr_chan, f) == value)) {
+       return;
+    }
+
+    switch (f) {
+       case F_MODE:
+          send_command(fd, "AT+MODE+%s", mode_names[(int)value]);
+          break;
+       case F_SWEEP:
+          send_command(fd, "AT+SWEEP+%s", (value ? "ON" : "OFF"));
+          break;
+       case F_CHAN:
+          brd->curr_chan = value;
+          send_command(fd, "AT+CHANNEL+%i", brd->curr_chan);
+          break;
+       default:
+          send_command(fd, "AT+%s+%.0f", fields[f].key, value);
+          break;
+    }
+    query_field(fd, f, 1);
+
+    if (f == F_CHAN && refresh_policy == REFRESH_EAGER) {
+       chan_refresh(fd, brd->curr_chan);
+    }
+}
+
+/////////////////////////////////////////////////
+// Applying a config: rather than replaying it, the settings in it are
+// compared with what we know of the board and only the differences are
+// sent, a channel at a time (mode first), ending on the channel it selects.
+struct apply_target {
+    double value[MAX_CHAN][F_MAX];	// board-wide fields (ref, mult) are in [0]
+    unsigned char set[MAX_CHAN][F_MAX];
+    int final_chan;			// last chan it selects, 0 if none
+};
+
+// Field order within a channel. Sweep limits are swapped when needed to
+// keep start <= end along the way, and sweep on goes after the rest.
+static const int apply_order[] = {
+    F_MODE, F_FREQ, F_PHASE, F_POWER, F_START_FREQ, F_END_FREQ,
+    F_START_POWER, F_END_POWER, F_STEP, F_TIME, F_SWEEP
+};
+
+const char *apply_value(int f, double v, char *buf, size_t bufsz) {
+    if (f == F_MODE) {
+       return (v >= 0 && v < NUM_MODES ? mode_names[(int)v] : "?");
+    } else if (f == F_SWEEP) {
+       return (v ? "on" : "off");
+    }
+    snprintf(buf, bufsz, "%.0f", v);
+    return buf;
+}
+
+// Send f (on chan, if it's per channel) unless it's already value. Returns 1 if it was sent.
+// stale says what we know of it no longer counts (the channel's mode was just changed).
+int apply_field(int fd, int chan, int f, double value, int stale) {
+    char label[32], was[32], now[32];
+    int known;
+
+    if (f >= F_CHAN) {
+       chan = brd->curr_chan;
+       snprintf(label, sizeof(label), "%s", fields[f].name);
+    } else {
+       snprintf(label, sizeof(label), "chan %d %s", chan, fields[f].name);
+    }
+    known = (!stale && field_fresh(chan, f));
+    if (known && field_value(chan, f) == value) {
+       return 0;
+    }
+    if (chan != brd->curr_chan) {
+       script_set(fd, F_CHAN, chan);
+    }
+    out_printf("* apply: %s %s -> %s\n", label, (known ? apply_value(f, field_value(chan, f), was, sizeof(was)) : "?"),
+           apply_value(f, value, now, sizeof(now)));
+    script_set(fd, f, value);
+    return 1;
+}
+
+void apply_config(int fd, const char *path) {
+    struct script *s = script_load(path);
+    struct apply_target t;
+    int chan = brd->curr_chan, changed = 0, total = 0;
+
+    if (s == NULL) {
+       return;
+    }
+    memset(&t, 0, sizeof(t));
+
+    // work out where the config wants everything to end up
+    for (int i = 0; i < s->nops; i++) {
+       struct script_op *o = &s->ops[i];
+
+       if (o->op == OP_SET && o->field == F_CHAN) {
+          chan = t.final_chan = o->value;
+       } else if (o->op == OP_SET) {
+          int c = (o->field < F_CHAN ? chan : 1);
+          t.value[c-1][o->field] = o->value;
+          t.set[c-1][o->field] = 1;
+       } else if (o->op == OP_CONSOLE) {
+          out_printf("* apply: %s:%d isn't a setting, skipped\n", path, o->line);
+       }
+    }
+
+    // the reference clock and multiplier before any frequencies
+    for (int f = F_REF; f <= F_MULT; f++) {
+       if (t.set[0][f]) {
+          total++;
+          changed += apply_field(fd, 1, f, t.value[0][f], 0);
+       }
+    }
+
+    // the channel we're on first and the one it leaves selected last, to save switching
+    int order[MAX_CHAN], n = 0;
+    order[n++] = brd->curr_chan;
+    for (int c = 1; c <= MAX_CHAN; c++) {
+       if (c != order[0] && c != t.final_chan) {
+          order[n++] = c;
+       }
+    }
+    if (t.final_chan && t.final_chan != order[0]) {
+       order[n++] = t.final_chan;
+    }
+
+    for (int i = 0; i < n; i++) {
+       int c = order[i];
+       double *v = t.value[c-1];
+       unsigned char *set = t.set[c-1];
+       int stale = 0;	// the mode's been changed, the board may have changed the rest with it
+
+       for (int k = 0; k < (int)(sizeof(apply_order) / sizeof(apply_order[0])); k++) {
+          int f = apply_order[k];
+
+          // raising the sweep above the current end? move the end first
+          if (f == F_START_FREQ && set[F_START_FREQ] && set[F_END_FREQ] &&
+              v[F_START_FREQ] > field_value(c, F_END_FREQ)) {
+             total++;
+             changed += apply_field(fd, c, F_END_FREQ, v[F_END_FREQ], stale);
+             set[F_END_FREQ] = 0;
+          }
+          if (set[f]) {
+             total++;
+             if (apply_field(fd, c, f, v[f], stale)) {
+                changed++;
+                stale |= (f == F_MODE);
+             }
+          }
+       }
+    }
+
+    // the channel it leaves selected is a setting too
+    if (t.final_chan) {
+       total++;
+       if (brd->curr_chan != t.final_chan) {
+          script_set(fd, F_CHAN, t.final_chan);
+          changed++;
+       }
+    }
+    out_printf("* apply: %s: %d of %d settings changed\n", path, changed, total);
+}
+
+void c_apply(int fd, char *argv[], int argc) {
+    apply_config(fd, argv[0]);
+}
+
+// Run the next op of the running script. Returns 0 if there's nothing to run.
+int script_step(int fd) {
+    struct script *s = script_running;
+
+    if (s == NULL) {
+       return 0;
+    }
+    // held back until what's been sent so far is answered
+    if (script_hold) {
+       if (!boards_idle()) {
+          return 0;
+       }
+       script_hold = 0;
+    }
+    if (script_pc >= s->nops) {
+       if (debug) {
+          out_printf("script: %s finished\n", s->path);
+       }
+       script_running = NULL;
+       return 0;
+    }
+
+    struct script_op *o = &s->ops[script_pc++];
+    if (debug > 1) {
+       out_printf("script: %s:%d\n", s->path, o->line);
+    }
+
+    switch (o->op) {
+       case OP_SET:
+          script_set(fd, o->field, o->value);
+          break;
+       case OP_SLEEP:
+          sleep_start(o->value);
+          break;
+       case OP_QUIT:
+          script_running = NULL;
+          c_quit(fd, NULL, 0);
+          break;
+       case OP_CONSOLE: {
+          char line[BUFFER_SIZE];
+          // handle_command() chops up what it's given
+          snprintf(line, sizeof(line), "%s", s->text + o->text);
+          handle_command(fd, line);
+          break;
+       }
+    }
+    return 1;
+}
+
+/////////////////////////////////////////////////
+// Frequency plans. The board takes whole Hz and turns them into a 32 bit
+// frequency tuning word, FTW = Hz * 2^32 / sysclk (ref * mult), which we
+// take to be rounded to the nearest. plan works out, a block at a time,
+// the whole Hz that gets each point closest to what was asked for once
+// it's been through that, and writes the lot to a binary file with what
+// it'll send, the FTW and the error. hop load and hsweep list take it as
+// it is (mmap()ed, nothing to parse), as many points as it has, and keep
+// it mapped, reading each point as it's sent rather than copying them.
+struct plan_header {
+    uint32_t magic;
+    uint32_t size;		// of this header, the points follow it
+    uint32_t count;
+    uint32_t ref_clk, clk_mult;	// what the FTWs were worked out for
+    uint32_t merged;		// points dropped for landing on the same Hz as the one before
+    double max_error, rms_error;	// Hz
+};
+
+struct plan_point {
+    uint32_t hz;		// what's sent
+    uint32_t ftw;		// what the board makes of it
+    double error;		// achieved - asked for, Hz
+};
+
+struct plan_map {
+    struct plan_header *hdr;
+    struct plan_point *points;
+    size_t len;
+};
+
+// Is path a frequency plan (rather than text)?
+int plan_is(const char *path) {
+    uint32_t magic = 0;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+       return 0;
+    }
+    if (fread(&magic, sizeof(magic), 1, fp) != 1) {
+       magic = 0;
+    }
+    fclose(fp);
+    return (magic == PLAN_MAGIC);
+}
+
+void plan_close(struct plan_map *m) {
+    if (m->hdr) {
+       munmap(m->hdr, m->len);
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+// Map a plan in. Returns -1 (having said why) if it's no good.
+int plan_open(struct plan_map *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    void *p;
+
+    memset(m, 0, sizeof(*m));
+    if (fd < 0 || fstat(fd, &st) < 0) {
+       int my_errno = errno;
+       out_printf("*** Error opening plan %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       if (fd >= 0) {
+          close(fd);
+       }
+       return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct plan_header) ||
+        (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+       out_printf("*** %s isn't a frequency plan\n", path);
+       close(fd);
+       return -1;
+    }
+    close(fd);
+    m->hdr = p;
+    m->len = st.st_size;
+    m->points = (struct plan_point *)((char *)p + sizeof(struct plan_header));
+
+    if (m->hdr->magic != PLAN_MAGIC || m->hdr->size != sizeof(struct plan_header) || m->hdr->count == 0 ||
+        m->len != sizeof(struct plan_header) + (size_t)m->hdr->count * sizeof(struct plan_point)) {
+       out_printf("*** %s isn't a frequency plan (or it's been cut short)\n", path);
+       plan_close(m);
+       return -1;
+    }
+    madvise(p, m->len, MADV_SEQUENTIAL);
+
+    // the FTWs (and errors) only hold for the clock they were worked out for
+    if ((double)m->hdr->ref_clk * m->hdr->clk_mult != (double)brd->ref_clk * brd->clk_mult) {
+       out_printf("* Plan %s is for a %.0f Hz system clock, %sboard's at %.0f Hz\n", path,
+              (double)m->hdr->ref_clk * m->hdr->clk_mult, board_tag(), (double)brd->ref_clk * brd->clk_mult);
+    }
+    return 0;
+}
+
+// The whole Hz closest to each of want[] once it's been made into an FTW,
+// with the FTW and the error. Built on its own at -O3, see plan-quantize.c.
+void plan_quantize(const double *restrict want, double *restrict hz, double *restrict ftw,
+                   double *restrict error, int n, double sysclk);
+
+// Point i of n: lin/log from start to end, or raster from start, arg apart
+static void plan_fill(int kind, double start, double arg, double end, double n, uint32_t first, double *want, int count) {
+    for (int i = 0; i < count; i++) {
+       double k = (double)first + i;
+
+       if (kind == 0) {
+          want[i] = start + (end - start) * (k / (n - 1));
+       } else if (kind == 1) {
+          want[i] = start * pow(end / start, k / (n - 1));
+       } else {
+          want[i] = start + arg * k;
+       }
+    }
+}
+
+// lin|log start end points file, raster start spacing count file
+static void plan_make(char *argv[], int argc) {
+    int kind = (strcasecmp(argv[0], "lin") == 0 ? 0 : (strcasecmp(argv[0], "log") == 0 ? 1 : 2));
+    double start, arg, end, n, sysclk = (double)brd->ref_clk * brd->clk_mult;
+    struct plan_header hdr;
+    char tmp[PATH_MAX + 4];
+    double *want, *hz, *ftw, *error;
+    struct plan_point *pts;
+    FILE *fp;
+
+    if (argc != 5) {
+       out_printf("*** Usage: plan %s\n", (kind == 2 ? "raster start spacing count file" : "lin|log start end points file"));
+       return;
+    }
+    if (parse_hertz(argv[1], &start) < 0 || parse_hertz(argv[2], &arg) < 0 ||
+        parse_number(argv[3], &n) < 0 || n < (kind == 2 ? 1 : 2) || n > PLAN_MAX || n != floor(n)) {
+       out_printf("*** Invalid plan %s %s %s [1-%d points]\n", argv[1], argv[2], argv[3], PLAN_MAX);
+       return;
+    }
+    end = (kind == 2 ? start + arg * (n - 1) : arg);
+    if (start < MIN_FREQ || end < MIN_FREQ || fmax(start, end) > MAX_FREQ || (kind == 1 && start == end)) {
+       out_printf("*** Invalid plan %.3f-%.3f Hz [1-200,000,000]\n", start, end);
+       return;
+    }
+    // the tuning word's only 32 bits
+    if (fmax(start, end) + 1 >= sysclk / 2) {
+       out_printf("*** Frequencies up to %.0f Hz can't be made from a %.0f Hz system clock\n", fmax(start, end), sysclk);
+       return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[4]);
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error creating plan %s: %d (%s)\n", tmp, my_errno, strerror(my_errno));
+       return;
+    }
+    want = malloc(PLAN_BLOCK * 4 * sizeof(double));
+    pts = malloc(PLAN_BLOCK * sizeof(struct plan_point));
+    if (!want || !pts) {
+       abort();
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PLAN_MAGIC;
+    hdr.size = sizeof(hdr);
+    hdr.ref_clk = brd->ref_clk;
+    hdr.clk_mult = brd->clk_mult;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    hz = want + PLAN_BLOCK;
+    ftw = hz + PLAN_BLOCK;
+    error = ftw + PLAN_BLOCK;
+
+    int64_t t0 = mono_usec();
+    uint32_t last_hz = 0;
+    double sq = 0;
+    for (uint32_t first = 0; first < n; first += PLAN_BLOCK) {
+       int count = (n - first < PLAN_BLOCK ? n - first : PLAN_BLOCK), kept = 0;
+
+       plan_fill(kind, start, arg, end, n, first, want, count);
+       plan_quantize(want, hz, ftw, error, count, sysclk);
+
+       // a raster finer than 1 Hz lands on the same Hz more than once
+       for (int i = 0; i < count; i++) {
+          if (hz[i] == last_hz) {
+             hdr.merged++;
+             continue;
+          }
+          last_hz = hz[i];
+          sq += error[i] * error[i];
+          if (fabs(error[i]) > hdr.max_error) {
+             hdr.max_error = fabs(error[i]);
+          }
+          pts[kept].hz = hz[i];
+          pts[kept].ftw = ftw[i];
+          pts[kept].error = error[i];
+          kept++;
+       }
+       hdr.count += kept;
+       fwrite(pts, sizeof(struct plan_point), kept, fp);
+    }
+    hdr.rms_error = sqrt(sq / hdr.count);
+    free(want);
+    free(pts);
+
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if (ferror(fp) | fclose(fp) || rename(tmp, argv[4]) < 0) {
+       int my_errno = errno;
+       out_printf("*** Error writing plan %s: %d (%s)\n", argv[4], my_errno, strerror(my_errno));
+       unlink(tmp);
+       return;
+    }
+    int64_t took = mono_usec() - t0;
+    out_printf("* Plan %s: %u points (%u merged), error max %.4f rms %.4f Hz, %.0f points/s\n", argv[4], hdr.count,
+           hdr.merged, hdr.max_error, hdr.rms_error, n * 1000000.0 / (took > 0 ? took : 1));
+}
+
+void c_plan(int fd, char *argv[], int argc) {
+    if (strcasecmp(argv[0], "lin") == 0 || strcasecmp(argv[0], "log") == 0 || strcasecmp(argv[0], "raster") == 0) {
+       plan_make(argv, argc);
+       return;
+    }
+
+    // what's in one
+    struct plan_map m;
+    if (plan_open(&m, argv[0]) < 0) {
+       return;
+    }
+    struct plan_point *a = &m.points[0], *b = &m.points[m.hdr->count - 1];
+    out_printf("* Plan %s: %u points (%u merged) for a %u x %u Hz clock, error max %.4f rms %.4f Hz\n", argv[0],
+           m.hdr->count, m.hdr->merged, m.hdr->ref_clk, m.hdr->clk_mult, m.hdr->max_error, m.hdr->rms_error);
+    out_printf("* First %u Hz (FTW 0x%08x, %+.4f), last %u Hz (FTW 0x%08x, %+.4f)\n",
+           a->hz, a->ftw, a->error, b->hz, b->ftw, b->error);
+    plan_close(&m);
+}
+
+/////////////////////////////////////////////////
+// Frequency hopping. A hop table is a list of points (chan freq [phase
+// [power]]) which are rendered into AT commands once, when it's loaded.
+// Each point only carries the commands for what's different from where the
+// table left that channel, and there are no readbacks, so a hop is usually a
+// single AT+FRE. The first lap can't assume anything, so it gets its own set.
+// A frequency plan isn't rendered: it stays mapped and each hop's AT+FRE is
+// formatted from it as it goes, so a plan costs no more memory than its file.
+struct hop_point {
+    int chan;
+    int first[2], count[2];	// frames[] used on the first lap / every lap after
+};
+
+struct hop_table {
+    char *path;
+    struct hop_point *points;
+    int npoints, points_sz;
+    struct at_cmd *frames;
+    int nframes, frames_sz;
+    struct at_cmd chan_frames[MAX_CHAN];
+    struct plan_map plan;	// hopping through a plan instead (hdr is NULL if not)
+    int plan_chan;
+    // running
+    int running;
+    struct board *board;
+    int pos, lap;
+    int dwell;			// ms between hops, 0 = as fast as the board answers
+    unsigned long limit;	// stop after this many hops (0 = never)
+    unsigned long issued, done, late, bytes;
+    int64_t started, last_done, lat_min, lat_max, lat_sum;
+} hop;
+ev_timer hop_timer;
+
+static void hop_add_frame(struct hop_table *h, int chan, int f, double value) {
+    if (h->nframes == h->frames_sz) {
+       h->frames_sz = (h->frames_sz ? h->frames_sz * 2 : 256);
+       h->frames = realloc(h->frames, h->frames_sz * sizeof(struct at_cmd));
+       if (!h->frames) {
+          abort();
+       }
+    }
+    struct at_cmd *cmd = &h->frames[h->nframes++];
+    memset(cmd, 0, sizeof(*cmd));
+    snprintf(cmd->line, sizeof(cmd->line), "AT+%s+%.0f", fields[f].key, value);
+    cmd->chan = chan;
+    cmd_prepare(cmd);
+}
+
+void hop_free(struct hop_table *h) {
+    if (h->plan.hdr) {
+       plan_close(&h->plan);
+    }
+    free(h->path);
+    free(h->points);
+    free(h->frames);
+    memset(h, 0, sizeof(*h));
+}
+
+static void hop_render(struct hop_table *h, const double *vals);
+static void hop_chan_frames(struct hop_table *h);
+
+// Parse and render a hop table into h. Returns -1 (having said why) if it's no good.
+int hop_load(struct hop_table *h, const char *path) {
+    static const int cols[3] = { F_FREQ, F_PHASE, F_POWER };
+    FILE *fp = fopen(path, "r");
+    char line[BUFFER_SIZE];
+    int lineno = 0, errors = 0;
+    double *vals = NULL;	// npoints x 3, NAN where a column was left out
+
+    if (fp == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error opening hop table %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       return -1;
+    }
+    memset(h, 0, sizeof(*h));
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+       char *argv[5], *save = NULL, *tok;
+       char err[128];
+       int argc = 0;
+       double chan;
+
+       lineno++;
+       for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL && argc < 5; tok = strtok_r(NULL, " \t\r\n", &save)) {
+          argv[argc++] = tok;
+       }
+       if (argc == 0 || argv[0][0] == '#' || argv[0][0] == ';' || strncmp(argv[0], "//", 2) == 0) {
+          continue;
+       }
+       if (argc < 2 || argc > 4) {
+          out_printf("*** %s:%d: Need chan freq [phase [power]]\n", path, lineno);
+          errors++;
+          continue;
+       }
+       if (script_parse_value(F_CHAN, argv[0], &chan, err, sizeof(err)) < 0) {
+          out_printf("*** %s:%d: %s\n", path, lineno, err);
+          errors++;
+          continue;
+       }
+
+       if (h->npoints == h->points_sz) {
+          h->points_sz = (h->points_sz ? h->points_sz * 2 : 256);
+          h->points = realloc(h->points, h->points_sz * sizeof(struct hop_point));
+          vals = realloc(vals, h->points_sz * 3 * sizeof(double));
+          if (!h->points || !vals) {
+             abort();
+          }
+       }
+       double *v = &vals[h->npoints * 3];
+       h->points[h->npoints].chan = chan;
+       for (int c = 0; c < 3; c++) {
+          v[c] = NAN;
+          // '-' leaves it as it is
+          if (c + 1 < argc && strcmp(argv[c + 1], "-") != 0 &&
+              script_parse_value(cols[c], argv[c + 1], &v[c], err, sizeof(err)) < 0) {
+             out_printf("*** %s:%d: %s\n", path, lineno, err);
+             errors++;
+          }
+       }
+       h->npoints++;
+    }
+    fclose(fp);
+
+    if (errors || h->npoints == 0) {
+       if (!errors) {
+          out_printf("*** %s: No hops in table\n", path);
+       }
+       free(vals);
+       hop_free(h);
+       return -1;
+    }
+
+    hop_render(h, vals);
+    free(vals);
+    if (!(h->path = strdup(path))) {
+       abort();
+    }
+    return 0;
+}
+
+// Turn h's points, with their npoints x 3 column values, into frames
+static void hop_render(struct hop_table *h, const double *vals) {
+    static const int cols[3] = { F_FREQ, F_PHASE, F_POWER };
+
+    // walk the table twice: the first time nothing is known, the second
+    // time round we know what the end of the previous lap left behind
+    double last[MAX_CHAN][3];
+    for (int c = 0; c < MAX_CHAN * 3; c++) {
+       last[c / 3][c % 3] = NAN;
+    }
+    for (int lap = 0; lap < 2; lap++) {
+       for (int i = 0; i < h->npoints; i++) {
+          struct hop_point *p = &h->points[i];
+          const double *v = &vals[i * 3];
+
+          p->first[lap] = h->nframes;
+          for (int c = 0; c < 3; c++) {
+             if (!isnan(v[c]) && v[c] != last[p->chan-1][c]) {
+                hop_add_frame(h, p->chan, cols[c], v[c]);
+                last[p->chan-1][c] = v[c];
+             }
+          }
+          p->count[lap] = h->nframes - p->first[lap];
+       }
+    }
+    hop_chan_frames(h);
+}
+
+static void hop_chan_frames(struct hop_table *h) {
+    for (int c = 0; c < MAX_CHAN; c++) {
+       struct at_cmd *cmd = &h->chan_frames[c];
+       snprintf(cmd->line, sizeof(cmd->line), "AT+CHANNEL+%d", c + 1);
+       cmd->chan = c + 1;
+       cmd_prepare(cmd);
+    }
+}
+
+// A frequency plan as a hop table: every point on chan, frequency only
+int hop_load_plan(struct hop_table *h, const char *path, int chan) {
+    memset(h, 0, sizeof(*h));
+    if (plan_open(&h->plan, path) < 0) {
+       return -1;
+    }
+    if (!(h->path = strdup(path))) {
+       abort();
+    }
+    h->npoints = h->plan.hdr->count;
+    h->plan_chan = chan;
+    hop_chan_frames(h);
+    return 0;
+}
+
+// Commands the first lap and every lap after it send (channel switches aside)
+static void hop_count(int *first, int *steady) {
+    *first = *steady = 0;
+    if (hop.plan.hdr) {
+       const struct plan_point *pp = hop.plan.points;
+       for (int i = 0; i < hop.npoints; i++) {
+          *first += (i == 0 || pp[i].hz != pp[i - 1].hz);
+          *steady += (pp[i].hz != pp[(i ? i : hop.npoints) - 1].hz);
+       }
+       return;
+    }
+    for (int i = 0; i < hop.npoints; i++) {
+       *first += hop.points[i].count[0];
+       *steady += hop.points[i].count[1];
+    }
+}
+
+int hop_record(int64_t lat);
+
+// Send the next hop
+void hop_next(int fd) {
+    struct at_cmd *frames, plan_frame;
+    int lap = (hop.lap > 0);
+    int chan, n;
+
+    if (hop.plan.hdr) {
+       // a plan point only needs sending if it's not where the last one left us
+       uint32_t hz = hop.plan.points[hop.pos].hz;
+       int prev = (hop.pos ? hop.pos : hop.npoints) - 1;
+
+       chan = hop.plan_chan;
+       frames = &plan_frame;
+       n = (!(hop.pos == 0 && hop.lap == 0) && hop.plan.points[prev].hz == hz ? 0 : 1);
+       if (n) {
+          memset(&plan_frame, 0, sizeof(plan_frame));
+          snprintf(plan_frame.line, sizeof(plan_frame.line), "AT+%s+%u", fields[F_FREQ].key, hz);
+          plan_frame.chan = chan;
+          cmd_prepare(&plan_frame);
+       }
+    } else {
+       struct hop_point *p = &hop.points[hop.pos];
+       chan = p->chan;
+       frames = &hop.frames[p->first[lap]];
+       n = p->count[lap];
+    }
+    int sent = n;
+
+    // whatever else has gone on, the board has to be on the right channel
+    if (brd->curr_chan != chan) {
+       brd->curr_chan = chan;
+       brd->meta[F_CHAN].dirty = 1;
+       cmdq_push(fd, &hop.chan_frames[chan-1], (n == 0 ? CMD_HOP_END : 0));
+       hop.bytes += strlen(hop.chan_frames[chan-1].line) + 2;
+       sent++;
+    }
+    for (int i = 0; i < n; i++) {
+       struct at_cmd *cmd = &frames[i];
+
+       // the mirror's out of date until someone asks
+       field_meta(cmd->chan, cmd->field)->dirty = 1;
+       cmdq_push(fd, cmd, (i == n - 1 ? CMD_HOP_END : 0));
+       hop.bytes += strlen(cmd->line) + 2;
+    }
+    hop.issued++;
+
+    if (++hop.pos >= hop.npoints) {
+       hop.pos = 0;
+       hop.lap++;
+    }
+
+    // nothing to send means nothing to wait for
+    if (sent == 0) {
+       hop_record(0);
+    }
+}
+
+void hop_show_stats(void) {
+    double secs = (hop.done ? (hop.last_done - hop.started) / 1000000.0 : 0);
+    unsigned long finished = (hop.done ? hop.done : 1);
+
+    out_printf("* Hop: %lu hops in %.3f s (%.1f hops/s), %.1f bytes/hop, %lu late\n",
+           hop.done, secs, (secs > 0 ? hop.done / secs : 0.0), (double)hop.bytes / (hop.issued ? hop.issued : 1), hop.late);
+    out_printf("* Hop latency: min %.2f avg %.2f max %.2f ms\n",
+           hop.lat_min / 1000.0, hop.lat_sum / 1000.0 / finished, hop.lat_max / 1000.0);
+}
+
+void hop_stop(void) {
+    if (!hop.running) {
+       return;
+    }
+    hop.running = 0;
+    ev_timer_stop(loop, &hop_timer);
+}
+
+// Keep the window full of hops when there's no dwell
+static void hop_fill(int fd) {
+    while (hop.running && hop.dwell == 0 && !quit_msg && (hop.limit == 0 || hop.issued < hop.limit) &&
+           cmdq_waiting() == 0 && brd->cmdq.inflight < (unsigned)brd->cmdq.window) {
+       hop_next(fd);
+    }
+}
+
+// Account for a finished hop. Returns 1 if that was the last one.
+int hop_record(int64_t lat) {
+    hop.done++;
+    hop.last_done = mono_usec();
+    hop.lat_sum += lat;
+    if (hop.done == 1 || lat < hop.lat_min) {
+       hop.lat_min = lat;
+    }
+    if (lat > hop.lat_max) {
+       hop.lat_max = lat;
+    }
+
+    if (hop.running && hop.limit > 0 && hop.done >= hop.limit) {
+       hop_stop();
+       hop_show_stats();
+       return 1;
+    }
+    return 0;
+}
+
+// The board answered the last command of a hop
+void hop_done(int fd, int64_t sent) {
+    if (!hop_record(mono_usec() - sent)) {
+       hop_fill(fd);
+    }
+}
+
+static void hop_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    brd = hop.board;
+    if (quit_msg || (hop.limit > 0 && hop.issued >= hop.limit)) {
+       ev_timer_stop(loop, w);
+       return;
+    }
+    // don't let the queue grow if the board can't keep up
+    if (cmdq_waiting() > 0) {
+       hop.late++;
+       return;
+    }
+    hop_next(brd->fd);
+}
+
+void c_hop(int fd, char *argv[], int argc) {
+    if (argc == 0) {
+       if (hop.npoints == 0) {
+          out_printf("* No hop table loaded\n");
+          return;
+       }
+       out_printf("* Hop table %s: %d points, %s, at point %d (lap %d)\n", hop.path, hop.npoints,
+              (hop.running ? "running" : "stopped"), hop.pos + 1, hop.lap + 1);
+       hop_show_stats();
+    } else if (strcasecmp(argv[0], "load") == 0) {
+       struct hop_table h;
+
+       if (argc < 2) {
+          out_printf("*** hop load needs a file name\n");
+          return;
+       }
+       if (plan_is(argv[1])) {
+          // a plan's just frequencies, they go on chan (or the current one)
+          double chan = brd->curr_chan;
+          char err[128];
+
+          if (argc > 2 && script_parse_value(F_CHAN, argv[2], &chan, err, sizeof(err)) < 0) {
+             out_printf("*** %s\n", err);
+             return;
+          }
+          hop_stop();
+          if (hop_load_plan(&h, argv[1], chan) < 0) {
+             return;
+          }
+       } else if (argc > 2) {
+          out_printf("*** Only a frequency plan takes a channel\n");
+          return;
+       } else {
+          hop_stop();
+          if (hop_load(&h, argv[1]) < 0) {
+             return;
+          }
+       }
+       hop_free(&hop);
+       hop = h;
+
+       int first, steady;
+       hop_count(&first, &steady);
+       out_printf("* Hop table %s: %d points, %d commands first lap, %d per lap after\n",
+              hop.path, hop.npoints, first, steady);
+    } else if (hop.npoints == 0) {
+       out_printf("*** No hop table loaded\n");
+    } else if (strcasecmp(argv[0], "next") == 0) {
+       hop_next(fd);
+    } else if (strcasecmp(argv[0], "stop") == 0) {
+       hop_stop();
+       hop_show_stats();
+    } else if (strcasecmp(argv[0], "run") == 0) {
+       int dwell = (argc > 1 ? atoi(argv[1]) : 0);
+       long limit = (argc > 2 ? atol(argv[2]) : 0);
+
+       if (dwell < 0 || dwell > MAX_SLEEP || limit < 0) {
+          out_printf("*** Invalid argument to hop run: dwell [0-%d] ms, hops >= 0\n", MAX_SLEEP);
+          return;
+       }
+       // with no dwell, a lap that sends nothing would spin forever
+       int first, steady;
+       hop_count(&first, &steady);
+       for (int i = 0; !hop.plan.hdr && i < hop.npoints; i++) {
+          steady += (hop.points[i].chan != hop.points[0].chan);
+       }
+       if (dwell == 0 && steady == 0) {
+          out_printf("*** Hop table never changes anything after the first lap, give a dwell time\n");
+          return;
+       }
+       hop_stop();
+       hop.dwell = dwell;
+       hop.limit = limit;
+       hop.issued = hop.done = hop.late = hop.bytes = 0;
+       hop.lat_min = hop.lat_max = hop.lat_sum = 0;
+       hop.started = mono_usec();
+       hop.running = 1;
+       hop.board = brd;
+
+       if (dwell > 0) {
+          ev_timer_set(&hop_timer, 0., dwell / 1000.0);
+          ev_timer_start(loop, &hop_timer);
+       } else {
+          hop_fill(fd);
+       }
+    } else {
+       out_printf("*** Invalid argument %s to hop\n", argv[0]);
+    }
+}
+
+/////////////////////////////////////////////////
+// Host driven sweeps. Where the board's own sweep is linear and at most
+// 9999 ms, this steps AT+FRE (and AT+AMP if the plan has powers) from our
+// own timer through any list of points: linear and log segments, or a
+// list from a file, strung together. Every point has a planned time from
+// the start of the sweep, how far off that we actually send it is the jitter.
+// Points are sent without readbacks and without waiting for the previous
+// OK, so we're only limited by the link. Each point only sends what differs
+// from what the board was last sent, and a frequency plan is a single entry
+// read from its map as it goes rather than a copy of every point.
+struct sweep_point {
+    double freq;
+    double power;		// NAN to leave it alone
+    int64_t dwell;		// usec until the next point
+    struct plan_map *plan;	// or every point of this plan, without powers
+};
+
+struct host_sweep {
+    struct sweep_point *points;
+    int nentries, points_sz;
+    long npoints;		// counting every point of a plan
+    int segments;
+    // running
+    int running;
+    struct board *board;
+    int chan;
+    int pos;
+    uint32_t sub;		// point in a plan entry
+    double level;		// the power in effect (NAN if there's never been one)
+    double sent_freq, sent_power;	// what the board was last sent (NAN for nothing yet)
+    unsigned long loop, loops;	// loops = 0 runs until stopped
+    int64_t started, planned;	// when we started, when the next point is due (usec)
+    unsigned long steps, dropped;
+    int64_t jit_max;
+    double jit_sum, jit_sq;
+} hsweep;
+ev_timer hsweep_timer;
+
+static struct sweep_point *hsweep_add(double freq, double power, int64_t dwell) {
+    if (hsweep.nentries == hsweep.points_sz) {
+       hsweep.points_sz = (hsweep.points_sz ? hsweep.points_sz * 2 : 256);
+       hsweep.points = realloc(hsweep.points, hsweep.points_sz * sizeof(struct sweep_point));
+       if (!hsweep.points) {
+          abort();
+       }
+    }
+    struct sweep_point *p = &hsweep.points[hsweep.nentries++];
+    hsweep.npoints++;
+    memset(p, 0, sizeof(*p));
+    p->freq = freq;
+    p->power = power;
+    p->dwell = dwell;
+    return p;
+}
+
+// dwell in ms (fractions allowed), returns usec or -1
+static int64_t hsweep_parse_dwell(const char *arg) {
+    double ms;
+
+    if (parse_number(arg, &ms) < 0 || ms < 0.05 || ms > MAX_SLEEP) {
+       out_printf("*** Invalid dwell %s [0.05-%d] ms\n", arg, MAX_SLEEP);
+       return -1;
+    }
+    return (int64_t)(ms * 1000);
+}
+
+// lin|log start end points dwell [startpower [endpower]]
+static void hsweep_add_segment(int logsweep, char *argv[], int argc) {
+    double start, end, npoints, p0 = NAN, p1 = NAN;
+    char err[128];
+    int64_t dwell;
+
+    if (argc < 5) {
+       out_printf("*** Usage: hsweep %s start end points dwell [startpower [endpower]]\n", argv[0]);
+       return;
+    }
+    if (script_parse_value(F_FREQ, argv[1], &start, err, sizeof(err)) < 0 ||
+        script_parse_value(F_FREQ, argv[2], &end, err, sizeof(err)) < 0 ||
+        (argc > 5 && script_parse_value(F_POWER, argv[5], &p0, err, sizeof(err)) < 0) ||
+        (argc > 6 && script_parse_value(F_POWER, argv[6], &p1, err, sizeof(err)) < 0)) {
+       out_printf("*** %s\n", err);
+       return;
+    }
+    if (parse_number(argv[3], &npoints) < 0 || npoints < 2 || npoints > 1000000 || npoints != floor(npoints)) {
+       out_printf("*** Invalid number of points %s [2-1000000]\n", argv[3]);
+       return;
+    }
+    if ((dwell = hsweep_parse_dwell(argv[4])) < 0) {
+       return;
+    }
+    if (argc == 6) {
+       p1 = p0;
+    }
+
+    for (int i = 0; i < npoints; i++) {
+       double frac = i / (npoints - 1);
+       double freq = (logsweep ? start * pow(end / start, frac) : start + (end - start) * frac);
+       double power = (isnan(p0) ? NAN : round(p0 + (p1 - p0) * frac));
+
+       hsweep_add(round(freq), power, dwell);
+    }
+    hsweep.segments++;
+    out_printf("* Host sweep: added %s segment %.0f-%.0f Hz, %.0f points, now %ld points\n",
+           (logsweep ? "log" : "linear"), start, end, npoints, hsweep.npoints);
+}
+
+// Every point of a frequency plan, dwell apart. The plan stays mapped until hsweep clear.
+static void hsweep_add_plan(const char *path, int64_t dwell) {
+    struct plan_map *m = malloc(sizeof(*m));
+
+    if (!m) {
+       abort();
+    }
+    if (plan_open(m, path) < 0) {
+       free(m);
+       return;
+    }
+    struct sweep_point *p = hsweep_add(NAN, NAN, dwell);
+    p->plan = m;
+    hsweep.npoints += m->hdr->count - 1;
+    hsweep.segments++;
+    out_printf("* Host sweep: added %u points from plan %s, now %ld points\n", m->hdr->count, path, hsweep.npoints);
+}
+
+// list file [dwell]: lines of freq [power [dwell]], or a frequency plan
+static void hsweep_add_list(char *argv[], int argc) {
+    int64_t dwell = 1000;
+    char line[BUFFER_SIZE];
+    int lineno = 0, errors = 0, before = hsweep.nentries;
+    FILE *fp;
+
+    if (argc < 2) {
+       out_printf("*** Usage: hsweep list file [dwell]\n");
+       return;
+    }
+    if (argc > 2 && (dwell = hsweep_parse_dwell(argv[2])) < 0) {
+       return;
+    }
+    if (plan_is(argv[1])) {
+       hsweep_add_plan(argv[1], dwell);
+       return;
+    }
+    if ((fp = fopen(argv[1], "r")) == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error opening sweep list %s: %d (%s)\n", argv[1], my_errno, strerror(my_errno));
+       return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+       char *col[3], *save = NULL, *tok, err[128];
+       int ncol = 0;
+       double freq, power = NAN;
+       int64_t pdwell = dwell;
+
+       lineno++;
+       for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL && ncol < 3; tok = strtok_r(NULL, " \t\r\n", &save)) {
+          col[ncol++] = tok;
+       }
+       if (ncol == 0 || col[0][0] == '#' || col[0][0] == ';' || strncmp(col[0], "//", 2) == 0) {
+          continue;
+       }
+       if (script_parse_value(F_FREQ, col[0], &freq, err, sizeof(err)) < 0 ||
+           (ncol > 1 && strcmp(col[1], "-") != 0 && script_parse_value(F_POWER, col[1], &power, err, sizeof(err)) < 0)) {
+          out_printf("*** %s:%d: %s\n", argv[1], lineno, err);
+          errors++;
+          continue;
+       }
+       if (ncol > 2 && (pdwell = hsweep_parse_dwell(col[2])) < 0) {
+          out_printf("*** %s:%d: bad dwell\n", argv[1], lineno);
+          errors++;
+          continue;
+       }
+       hsweep_add(freq, power, pdwell);
+    }
+    fclose(fp);
+
+    if (errors) {
+       out_printf("*** %s: %d error%s, not added\n", argv[1], errors, (errors == 1 ? "" : "s"));
+       hsweep.npoints -= hsweep.nentries - before;
+       hsweep.nentries = before;
+       return;
+    }
+    hsweep.segments++;
+    out_printf("* Host sweep: added %d points from %s, now %ld points\n", hsweep.nentries - before, argv[1], hsweep.npoints);
+}
+
+static int hsweep_frame(struct at_cmd *cmd, int chan, int f, double value) {
+    memset(cmd, 0, sizeof(*cmd));
+    snprintf(cmd->line, sizeof(cmd->line), "AT+%s+%.0f", fields[f].key, value);
+    cmd->chan = chan;
+    cmd_prepare(cmd);
+    return 1;
+}
+
+void hsweep_show_stats(void) {
+    double n = (hsweep.steps ? hsweep.steps : 1);
+    double mean = hsweep.jit_sum / n;
+
+    out_printf("* Host sweep: %lu steps (%lu loops), %lu dropped\n", hsweep.steps, hsweep.loop, hsweep.dropped);
+    out_printf("* Host sweep jitter: avg %.1f rms %.1f max %.1f us late\n",
+           mean, sqrt(hsweep.jit_sq / n), (double)hsweep.jit_max);
+}
+
+void hsweep_stop(void) {
+    if (!hsweep.running) {
+       return;
+    }
+    hsweep.running = 0;
+    ev_timer_stop(loop, &hsweep_timer);
+    hsweep_show_stats();
+}
+
+// Send every point that's due, then sleep until the next one is
+static void hsweep_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    brd = hsweep.board;
+    int fd = brd->fd;
+    int64_t now = mono_usec();
+
+    if (quit_msg) {
+       hsweep_stop();
+       return;
+    }
+
+    while (hsweep.running && hsweep.planned <= now) {
+       struct sweep_point *p = &hsweep.points[hsweep.pos];
+       double freq = (p->plan ? p->plan->points[hsweep.sub].hz : p->freq);
+       struct at_cmd frames[2];
+       int n = 0;
+
+       // points without a power keep the last one that had one
+       if (!p->plan && !isnan(p->power)) {
+          hsweep.level = p->power;
+       }
+
+       // if the board can't keep up, drop points rather than queue them up forever.
+       // What was sent stays as it was, so the next point to go sends whatever it needs.
+       if (cmdq_waiting() >= CMDQ_SIZE / 4) {
+          hsweep.dropped++;
+       } else {
+          if (freq != hsweep.sent_freq || hsweep.npoints == 1) {
+             n += hsweep_frame(&frames[n], hsweep.chan, F_FREQ, freq);
+             hsweep.sent_freq = freq;
+          }
+          if (!isnan(hsweep.level) && hsweep.level != hsweep.sent_power) {
+             n += hsweep_frame(&frames[n], hsweep.chan, F_POWER, hsweep.level);
+             hsweep.sent_power = hsweep.level;
+          }
+          if (brd->curr_chan != hsweep.chan) {
+             send_command(fd, "AT+CHANNEL+%d", hsweep.chan);
+             brd->curr_chan = hsweep.chan;
+             brd->meta[F_CHAN].dirty = 1;
+          }
+          for (int i = 0; i < n; i++) {
+             field_meta(hsweep.chan, frames[i].field)->dirty = 1;
+             cmdq_push(fd, &frames[i], 0);
+          }
+          // out now rather than at the end of the loop iteration
+          tx_flush(fd);
+
+          int64_t late = mono_usec() - hsweep.planned;
+          hsweep.steps++;
+          hsweep.jit_sum += late;
+          hsweep.jit_sq += (double)late * late;
+          if (late > hsweep.jit_max) {
+             hsweep.jit_max = late;
+          }
+       }
+
+       hsweep.planned += p->dwell;
+       if (!p->plan || ++hsweep.sub >= p->plan->hdr->count) {
+          hsweep.sub = 0;
+          if (++hsweep.pos >= hsweep.nentries) {
+             hsweep.pos = 0;
+             if (++hsweep.loop == hsweep.loops) {
+                hsweep_stop();
+                return;
+             }
+          }
+       }
+       now = mono_usec();
+    }
+
+    ev_now_update(loop);
+    ev_timer_set(w, (hsweep.planned - mono_usec()) / 1000000.0, 0.);
+    ev_timer_start(loop, w);
+}
+
+void c_hsweep(int fd, char *argv[], int argc) {
+    if (argc == 0) {
+       int64_t total = 0;
+       for (int i = 0; i < hsweep.nentries; i++) {
+          struct sweep_point *p = &hsweep.points[i];
+          total += p->dwell * (p->plan ? p->plan->hdr->count : 1);
+       }
+       out_printf("* Host sweep: %ld points in %d segments, %.3f s per loop, %s\n", hsweep.npoints, hsweep.segments,
+              total / 1000000.0, (hsweep.running ? "running" : "stopped"));
+       hsweep_show_stats();
+    } else if (strcasecmp(argv[0], "lin") == 0 || strcasecmp(argv[0], "log") == 0) {
+       if (hsweep.running) {
+          out_printf("*** Host sweep is running, stop it first\n");
+          return;
+       }
+       hsweep_add_segment(strcasecmp(argv[0], "log") == 0, argv, argc);
+    } else if (strcasecmp(argv[0], "list") == 0) {
+       if (hsweep.running) {
+          out_printf("*** Host sweep is running, stop it first\n");
+          return;
+       }
+       hsweep_add_list(argv, argc);
+    } else if (strcasecmp(argv[0], "clear") == 0) {
+       hsweep_stop();
+       for (int i = 0; i < hsweep.nentries; i++) {
+          if (hsweep.points[i].plan) {
+             plan_close(hsweep.points[i].plan);
+             free(hsweep.points[i].plan);
+          }
+       }
+       hsweep.nentries = hsweep.segments = 0;
+       hsweep.npoints = 0;
+    } else if (strcasecmp(argv[0], "stop") == 0) {
+       hsweep_stop();
+    } else if (strcasecmp(argv[0], "run") == 0) {
+       long loops = (argc > 1 ? atol(argv[1]) : 1);
+
+       if (hsweep.npoints == 0) {
+          out_printf("*** No host sweep points, add some with hsweep lin/log/list\n");
+          return;
+       }
+       if (loops < 0) {
+          out_printf("*** Invalid argument to hsweep run: loops >= 0 (0 = until stopped)\n");
+          return;
+       }
+       hsweep_stop();
+       // going round again we start with the last power in the list
+       hsweep.level = NAN;
+       for (int i = 0; i < hsweep.nentries; i++) {
+          if (!hsweep.points[i].plan && !isnan(hsweep.points[i].power)) {
+             hsweep.level = hsweep.points[i].power;
+          }
+       }
+       hsweep.sent_freq = hsweep.sent_power = NAN;
+       hsweep.chan = brd->curr_chan;
+       hsweep.loops = loops;
+       hsweep.loop = 0;
+       hsweep.pos = 0;
+       hsweep.sub = 0;
+       hsweep.steps = hsweep.dropped = 0;
+       hsweep.jit_max = 0;
+       hsweep.jit_sum = hsweep.jit_sq = 0;
+       hsweep.started = hsweep.planned = mono_usec();
+       hsweep.running = 1;
+       hsweep.board = brd;
+       out_printf("* Host sweep: running %ld points on chan %d\n", hsweep.npoints, hsweep.chan);
+       hsweep_timer_cb(loop, &hsweep_timer, 0);
+    } else {
+       out_printf("*** Invalid argument %s to hsweep\n", argv[0]);
+    }
+}
+
+/////////////////////////////////////////////////
+// Host keying. With P0-P3 not wired up, the board's FSK and AM modes are
+// no use, so CW and FSK beacons are keyed from here by sending AT+AMP
+// and AT+FRE at every symbol edge. A key schedule is a list of symbols,
+// each a tone and/or a power held for a time, built up from morse text,
+// FSK symbol strings, tones and gaps. It's rendered into frames like a
+// hop table when it runs. Edges are timed with a CLOCK_MONOTONIC timerfd
+// armed for the absolute time each is due (less a bit that's spun off),
+// so nothing drifts or gets rounded to the loop's cached time, optionally
+// under SCHED_FIFO with memory locked. How late each edge's write goes out, and how far each
+// symbol's length comes out from what it should be, is the jitter.
+#define	KEY_ON		-1.0		// symbol power: key down, at the channel's power when the run starts
+#define	KEY_LEAD	200		// usec before an edge to wake up and spin, wakeups are never on time
+
+struct key_symbol {
+    double freq;		// NAN to leave it alone
+    double power;		// NAN to leave it alone, KEY_ON for key down
+    int64_t len;		// usec
+    int first[2], count[2];	// frames[] used on the first loop / every loop after
+};
+
+struct key_sched {
+    struct key_symbol *syms;
+    int nsyms, syms_sz;
+    int64_t total;		// usec per loop
+    struct at_cmd *frames;
+    int nframes, frames_sz;
+    struct at_cmd up;		// AT+AMP+0 for when it's stopped
+    int rt_prio;		// SCHED_FIFO priority to run at, 0 = normal scheduling
+    int tfd;			// timerfd the edges come from
+    // running
+    int running;
+    int rt;			// what we got: 1 = SCHED_FIFO, 2 = memory locked
+    struct board *board;
+    int chan, pos;
+    unsigned long loop, loops;	// loops = 0 runs until stopped
+    int64_t period;		// usec from one loop's start to the next, 0 = back to back
+    int idle_up;		// key goes up between periods
+    int idle;			// at planned: 1 = key up and wait for the next period, 2 = stop
+    int64_t loop_start, planned, last_planned, last_edge;
+    unsigned long edges, held;
+    int64_t late_max, len_max;
+    double late_sum, late_sq, len_sq;
+} key = { .tfd = -1 };
+ev_io key_watcher;
+
+static const char *morse[128] = {
+    ['A'] = ".-", ['B'] = "-...", ['C'] = "-.-.", ['D'] = "-..", ['E'] = ".", ['F'] = "..-.",
+    ['G'] = "--.", ['H'] = "....", ['I'] = "..", ['J'] = ".---", ['K'] = "-.-", ['L'] = ".-..",
+    ['M'] = "--", ['N'] = "-.", ['O'] = "---", ['P'] = ".--.", ['Q'] = "--.-", ['R'] = ".-.",
+    ['S'] = "...", ['T'] = "-", ['U'] = "..-", ['V'] = "...-", ['W'] = ".--", ['X'] = "-..-",
+    ['Y'] = "-.--", ['Z'] = "--..",
+    ['0'] = "-----", ['1'] = ".----", ['2'] = "..---", ['3'] = "...--", ['4'] = "....-",
+    ['5'] = ".....", ['6'] = "-....", ['7'] = "--...", ['8'] = "---..", ['9'] = "----.",
+    ['/'] = "-..-.", ['?'] = "..--..", ['='] = "-...-", ['.'] = ".-.-.-", [','] = "--..--",
+    ['+'] = ".-.-.", ['-'] = "-....-"
+};
+
+// Add a symbol, or stretch the last one if it doesn't change anything
+static void key_add(double freq, double power, int64_t len) {
+    struct key_symbol *last = (key.nsyms ? &key.syms[key.nsyms - 1] : NULL);
+
+    key.total += len;
+    if (last && (freq == last->freq || (isnan(freq) && isnan(last->freq))) &&
+        (power == last->power || (isnan(power) && isnan(last->power)))) {
+       last->len += len;
+       return;
+    }
+    if (key.nsyms == key.syms_sz) {
+       key.syms_sz = (key.syms_sz ? key.syms_sz * 2 : 256);
+       key.syms = realloc(key.syms, key.syms_sz * sizeof(struct key_symbol));
+       if (!key.syms) {
+          abort();
+       }
+    }
+    struct key_symbol *s = &key.syms[key.nsyms++];
+    memset(s, 0, sizeof(*s));
+    s->freq = freq;
+    s->power = power;
+    s->len = len;
+}
+
+// cw wpm text..., keyed on and off with the power. PARIS timing: a dit
+// is 1.2 s / wpm, a dah 3 dits, 1 dit between elements, 3 between
+// letters and 7 between words.
+static void key_add_cw(char *argv[], int argc) {
+    double wpm;
+    int64_t dit;
+    int before = key.nsyms;
+
+    if (argc < 3 || parse_number(argv[1], &wpm) < 0 || wpm < 1 || wpm > 200) {
+       out_printf("*** Usage: key cw wpm [1-200] text\n");
+       return;
+    }
+    for (int a = 2; a < argc; a++) {
+       for (const char *p = argv[a]; *p; p++) {
+          if ((unsigned char)*p >= 128 || morse[toupper((unsigned char)*p)] == NULL) {
+             out_printf("*** No morse for '%c' in %s\n", *p, argv[a]);
+             return;
+          }
+       }
+    }
+    dit = (int64_t)round(1200000.0 / wpm);
+
+    for (int a = 2; a < argc; a++) {
+       if (a > 2) {
+          key_add(NAN, 0, 4 * dit);	// on top of the letter gap
+       }
+       for (const char *p = argv[a]; *p; p++) {
+          for (const char *e = morse[toupper((unsigned char)*p)]; *e; e++) {
+             key_add(NAN, KEY_ON, (*e == '-' ? 3 : 1) * dit);
+             key_add(NAN, 0, dit);
+          }
+          key_add(NAN, 0, 2 * dit);
+       }
+    }
+    out_printf("* Key: added %d symbols of morse at %.1f wpm (%.1f ms dit), now %.3f s\n",
+           key.nsyms - before, wpm, dit / 1000.0, key.total / 1000000.0);
+}
+
+// fsk base spacing baud symbols, symbol n is a tone at base + n * spacing.
+// Symbol edges are placed from the start of the string, so a baud rate
+// that isn't a whole number of usec doesn't add up to a drift.
+static void key_add_fsk(char *argv[], int argc) {
+    double base, spacing, baud, worst = 0;
+    int ntones = 0;
+    char err[128];
+
+    if (argc != 5) {
+       out_printf("*** Usage: key fsk base spacing baud symbols\n");
+       return;
+    }
+    if (script_parse_value(F_FREQ, argv[1], &base, err, sizeof(err)) < 0) {
+       out_printf("*** %s\n", err);
+       return;
+    }
+    if (parse_number(argv[2], &spacing) < 0 || parse_number(argv[3], &baud) < 0 || baud <= 0 || baud > 1000) {
+       out_printf("*** Invalid spacing or baud [0-1000] to key fsk\n");
+       return;
+    }
+    for (const char *p = argv[4]; *p; p++) {
+       if (!isdigit((unsigned char)*p)) {
+          out_printf("*** FSK symbols are digits, not '%c'\n", *p);
+          return;
+       }
+       double hz = base + (*p - '0') * spacing;
+       if (hz < 1 || hz > 200000000) {
+          out_printf("*** FSK tone %.1f Hz is out of range\n", hz);
+          return;
+       }
+       if (*p - '0' + 1 > ntones) {
+          ntones = *p - '0' + 1;
+       }
+       // the board only takes whole Hz
+       if (fabs(hz - round(hz)) > worst) {
+          worst = fabs(hz - round(hz));
+       }
+    }
+
+    int n = strlen(argv[4]);
+    for (int i = 0; i < n; i++) {
+       int64_t t0 = (int64_t)round(i * 1000000.0 / baud), t1 = (int64_t)round((i + 1) * 1000000.0 / baud);
+       key_add(round(base + (argv[4][i] - '0') * spacing), KEY_ON, t1 - t0);
+    }
+    out_printf("* Key: added %d symbols of %d-tone FSK, now %.3f s\n", n, ntones, key.total / 1000000.0);
+    if (worst > 0) {
+       out_printf("* Key: tones rounded to whole Hz, off by up to %.2f Hz\n", worst);
+    }
+}
+
+static void key_add_frame(int chan, int f, double value) {
+    if (key.nframes == key.frames_sz) {
+       key.frames_sz = (key.frames_sz ? key.frames_sz * 2 : 256);
+       key.frames = realloc(key.frames, key.frames_sz * sizeof(struct at_cmd));
+       if (!key.frames) {
+          abort();
+       }
+    }
+    struct at_cmd *cmd = &key.frames[key.nframes++];
+    memset(cmd, 0, sizeof(*cmd));
+    snprintf(cmd->line, sizeof(cmd->line), "AT+%s+%.0f", fields[f].key, value);
+    cmd->chan = chan;
+    cmd_prepare(cmd);
+}
+
+// Render the schedule for chan, key down being power on. With idle_up the
+// key goes up at the end of every loop, while it waits for the next period.
+static void key_render(int chan, int on, int idle_up) {
+    double last[2] = { NAN, NAN };
+
+    key.nframes = 0;
+    for (int lap = 0; lap < 2; lap++) {
+       for (int i = 0; i < key.nsyms; i++) {
+          struct key_symbol *s = &key.syms[i];
+          double power = (s->power == KEY_ON ? on : s->power);
+
+          s->first[lap] = key.nframes;
+          if (!isnan(s->freq) && s->freq != last[0]) {
+             key_add_frame(chan, F_FREQ, s->freq);
+             last[0] = s->freq;
+          }
+          if (!isnan(power) && power != last[1]) {
+             key_add_frame(chan, F_POWER, power);
+             last[1] = power;
+          }
+          s->count[lap] = key.nframes - s->first[lap];
+       }
+       key.idle_up = (idle_up && last[1] != 0);
+       if (key.idle_up) {
+          last[1] = 0;
+       }
+    }
+    memset(&key.up, 0, sizeof(key.up));
+    snprintf(key.up.line, sizeof(key.up.line), "AT+%s+0", fields[F_POWER].key);
+    key.up.chan = chan;
+    cmd_prepare(&key.up);
+}
+
+// Get the timerfd to fire at usec on the mono_usec() clock
+static void key_arm(int64_t usec) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(key.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void key_rt_enter(void) {
+    // the default 50us of slack is most of the jitter we'd otherwise get
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+    key.rt = 0;
+    if (key.rt_prio == 0) {
+       return;
+    }
+    struct sched_param sp = { .sched_priority = key.rt_prio };
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+       out_printf("*** Can't run SCHED_FIFO: %s\n", strerror(errno));
+    } else {
+       key.rt |= 1;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+       out_printf("*** Can't lock memory: %s\n", strerror(errno));
+    } else {
+       key.rt |= 2;
+    }
+}
+
+static void key_rt_leave(void) {
+    if (key.rt & 1) {
+       struct sched_param sp = { .sched_priority = 0 };
+       sched_setscheduler(0, SCHED_OTHER, &sp);
+    }
+    if (key.rt & 2) {
+       munlockall();
+    }
+    key.rt = 0;
+    prctl(PR_SET_TIMERSLACK, 0UL, 0UL, 0UL, 0UL);
+}
+
+void key_show_stats(void) {
+    double n = (key.edges ? key.edges : 1);
+    double n1 = (key.edges > 1 ? key.edges - 1 : 1);
+
+    out_printf("* Key: %lu edges (%lu loops), %lu held up by the window\n", key.edges, key.loop, key.held);
+    out_printf("* Key edge jitter: avg %.1f rms %.1f max %.1f us late, symbol length rms %.1f max %.1f us off\n",
+           key.late_sum / n, sqrt(key.late_sq / n), (double)key.late_max, sqrt(key.len_sq / n1), (double)key.len_max);
+}
+
+// Stop keying, with the key up
+void key_stop(void) {
+    if (!key.running) {
+       return;
+    }
+    key.running = 0;
+    ev_io_stop(loop, &key_watcher);
+    key_arm(0);
+    key_rt_leave();
+
+    brd = key.board;
+    field_meta(key.chan, F_POWER)->dirty = 1;
+    cmdq_push(brd->fd, &key.up, 0);
+    key_show_stats();
+}
+
+// Send one edge's frames, now, and account for how late it is
+static void key_edge(struct at_cmd *frames, int n) {
+    if (brd->curr_chan != key.chan) {
+       send_command(brd->fd, "AT+CHANNEL+%d", key.chan);
+       brd->curr_chan = key.chan;
+       brd->meta[F_CHAN].dirty = 1;
+    }
+    for (int i = 0; i < n; i++) {
+       field_meta(key.chan, frames[i].field)->dirty = 1;
+       cmdq_push(brd->fd, &frames[i], 0);
+    }
+    tx_flush(brd->fd);
+
+    // anything still waiting goes when there's room, which isn't when it should
+    if (cmdq_waiting() > 0) {
+       key.held++;
+    }
+    int64_t edge = mono_usec();
+    int64_t late = edge - key.planned;
+    key.late_sum += late;
+    key.late_sq += (double)late * late;
+    if (late > key.late_max) {
+       key.late_max = late;
+    }
+    if (key.edges > 0) {
+       int64_t off = llabs((edge - key.last_edge) - (key.planned - key.last_planned));
+       key.len_sq += (double)off * off;
+       if (off > key.len_max) {
+          key.len_max = off;
+       }
+    }
+    key.edges++;
+    key.last_edge = edge;
+    key.last_planned = key.planned;
+}
+
+// Send every symbol that's due, then sleep until the next one is
+static void key_timer_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    uint64_t expired;
+    int64_t now = mono_usec();
+
+    if (read(key.tfd, &expired, sizeof(expired)) < 0 && errno != EAGAIN) {
+       out_printf("*** Key timer: %s\n", strerror(errno));
+    }
+    brd = key.board;
+    if (quit_msg) {
+       key_stop();
+       return;
+    }
+
+    // woken KEY_LEAD early, spin the rest of the way
+    while (key.planned > now && key.planned - now <= KEY_LEAD) {
+       now = mono_usec();
+    }
+    while (key.running && key.planned <= now) {
+       // the end of the last loop, or of one that waits for the next period
+       if (key.idle == 2) {
+          key_stop();
+          return;
+       }
+       if (key.idle) {
+          key_edge(&key.up, 1);
+          key.idle = 0;
+          key.planned = key.loop_start;
+          now = mono_usec();
+          continue;
+       }
+
+       struct key_symbol *s = &key.syms[key.pos];
+       int lap = (key.loop > 0);
+
+       if (s->count[lap] > 0) {
+          key_edge(&key.frames[s->first[lap]], s->count[lap]);
+       }
+       key.planned += s->len;
+       if (++key.pos >= key.nsyms) {
+          key.pos = 0;
+          if (++key.loop == key.loops) {
+             key.idle = 2;
+          } else if (key.period > 0) {
+             key.loop_start += key.period;
+             if (key.idle_up) {
+                key.idle = 1;
+             } else {
+                key.planned = key.loop_start;
+             }
+          }
+       }
+       now = mono_usec();
+    }
+    key_arm(key.planned - KEY_LEAD);
+}
+
+void c_key(int fd, char *argv[], int argc) {
+    if (argc == 0) {
+       out_printf("* Key: %d symbols, %.3f s per loop, %s", key.nsyms, key.total / 1000000.0,
+              (key.running ? "running" : "stopped"));
+       if (key.rt_prio) {
+          out_printf(", SCHED_FIFO %d", key.rt_prio);
+       }
+       out_printf("\n");
+       key_show_stats();
+       return;
+    }
+    if (key.running && strcasecmp(argv[0], "stop") != 0) {
+       out_printf("*** Keying is running, stop it first\n");
+       return;
+    }
+
+    if (strcasecmp(argv[0], "cw") == 0) {
+       key_add_cw(argv, argc);
+    } else if (strcasecmp(argv[0], "fsk") == 0) {
+       key_add_fsk(argv, argc);
+    } else if (strcasecmp(argv[0], "tone") == 0 || strcasecmp(argv[0], "gap") == 0) {
+       int tone = (strcasecmp(argv[0], "tone") == 0);
+       double hz = NAN;
+       int64_t len;
+       char err[128];
+
+       if (argc != 2 + tone) {
+          out_printf("*** Usage: key %s\n", (tone ? "tone freq ms" : "gap ms"));
+          return;
+       }
+       if (tone && script_parse_value(F_FREQ, argv[1], &hz, err, sizeof(err)) < 0) {
+          out_printf("*** %s\n", err);
+          return;
+       }
+       if ((len = hsweep_parse_dwell(argv[1 + tone])) < 0) {
+          return;
+       }
+       key_add((tone ? round(hz) : NAN), (tone ? KEY_ON : 0), len);
+       out_printf("* Key: %d symbols, now %.3f s\n", key.nsyms, key.total / 1000000.0);
+    } else if (strcasecmp(argv[0], "clear") == 0) {
+       key.nsyms = 0;
+       key.total = 0;
+    } else if (strcasecmp(argv[0], "stop") == 0) {
+       key_stop();
+    } else if (strcasecmp(argv[0], "rt") == 0) {
+       if (argc > 1) {
+          int prio = (strcasecmp(argv[1], "off") == 0 ? 0 : atoi(argv[1]));
+          if (prio < 0 || prio > sched_get_priority_max(SCHED_FIFO) || (prio == 0 && strcasecmp(argv[1], "off") != 0)) {
+             out_printf("*** Invalid argument to key rt: priority [1-%d] | OFF\n", sched_get_priority_max(SCHED_FIFO));
+             return;
+          }
+          key.rt_prio = prio;
+       }
+       if (key.rt_prio) {
+          out_printf("* Key runs SCHED_FIFO at priority %d with memory locked\n", key.rt_prio);
+       } else {
+          out_printf("* Key runs with normal scheduling\n");
+       }
+    } else if (strcasecmp(argv[0], "run") == 0) {
+       double loops = 1, period = 0;
+
+       if (key.nsyms == 0) {
+          out_printf("*** No key schedule, add some with key cw/fsk/tone/gap\n");
+          return;
+       }
+       // a typo mustn't turn into 0, keying forever
+       if ((argc > 1 && (parse_number(argv[1], &loops) < 0 || loops < 0 || loops != floor(loops) || loops > LONG_MAX)) ||
+           (argc > 2 && (parse_number(argv[2], &period) < 0 || period < 0))) {
+          out_printf("*** Invalid argument to key run: loops >= 0 (0 = until stopped), period >= 0 s\n");
+          return;
+       }
+       if (period > 0 && period * 1000000 < key.total) {
+          out_printf("*** Key period %.3f s is shorter than the schedule (%.3f s)\n", period, key.total / 1000000.0);
+          return;
+       }
+       if (key.tfd < 0) {
+          out_printf("*** No timerfd for keying\n");
+          return;
+       }
+
+       // key down is whatever power the channel's at, or full if it's off or unknown
+       struct field_meta *pm = field_meta(brd->curr_chan, F_POWER);
+       int on = brd->chan_state[brd->curr_chan-1].power;
+       if (!pm->confirmed || pm->dirty || on <= 0) {
+          on = 1023;
+       }
+       key_render(brd->curr_chan, on, (period * 1000000 > key.total));
+       key.chan = brd->curr_chan;
+       key.board = brd;
+       key.loops = loops;
+       key.period = (int64_t)(period * 1000000);
+       key.loop = key.pos = key.idle = 0;
+       key.edges = key.held = 0;
+       key.late_max = key.len_max = 0;
+       key.late_sum = key.late_sq = key.len_sq = 0;
+       key_rt_enter();
+       key.running = 1;
+       out_printf("* Key: running %d symbols on chan %d, key down at power %d\n", key.nsyms, key.chan, on);
+
+       // give the board a moment to take anything queued ahead of us
+       key.loop_start = key.planned = mono_usec() + 1000;
+       ev_io_start(loop, &key_watcher);
+       key_arm(key.planned - KEY_LEAD);
+    } else {
+       out_printf("*** Invalid argument %s to key\n", argv[0]);
+    }
+}
+
+/////////////////////////////////////////////////
+// Flight recorder dumps and replay. A trace file is a header then the
+// frames oldest first, each a trace_rec (usec since the frame before) and
+// len bytes of line. Replaying
+// one on the selected board queues its commands without sending them and
+// feeds its replies through process_line() as if they'd just been read,
+// at the original pace (divided by speed, 0 = as fast as possible).
+struct trace_header {
+    uint32_t magic;
+    uint32_t size;		// of this header
+    uint32_t count;		// frames
+    uint32_t lost;		// recorded before these, and overwritten
+    int64_t t0;			// first frame's mono_usec()
+};
+
+struct trace_rec {
+    uint32_t usec;		// since the frame before
+    uint8_t dir, board;
+    uint16_t len;
+};
+
+struct trace_replay {
+    struct board *board;
+    unsigned char *data;	// the whole file
+    size_t len, pos;
+    uint32_t count, done;
+    double speed;
+    int64_t at, started;	// where the trace is up to (usec in), when we started
+    int window;			// board's, put back afterwards
+} replay;
+ev_timer replay_timer;
+ev_signal trace_signal;
+
+void process_line(int fd, const char *line);
+
+// Dump the ring to path. Returns -1 (having said why) if it couldn't.
+int trace_dump(const char *path) {
+    unsigned long first = (trace.head > TRACE_SIZE ? trace.head - TRACE_SIZE : 0);
+    struct trace_header hdr = { TRACE_MAGIC, sizeof(hdr), trace.head - first, first, 0 };
+    FILE *fp = fopen(path, "wb");
+    int64_t last;
+
+    if (fp == NULL) {
+       int my_errno = errno;
+       out_printf("*** Error creating trace %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       return -1;
+    }
+    if (hdr.count > 0) {
+       hdr.t0 = trace.frames[first & (TRACE_SIZE - 1)].usec;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    last = hdr.t0;
+    for (unsigned long i = first; i < trace.head; i++) {
+       struct trace_frame *t = &trace.frames[i & (TRACE_SIZE - 1)];
+       int64_t gap = t->usec - last;
+       struct trace_rec r = { (gap < UINT32_MAX ? gap : UINT32_MAX), t->dir, t->board, t->len };
+
+       last = t->usec;
+       fwrite(&r, sizeof(r), 1, fp);
+       fwrite(t->data, 1, t->len, fp);
+    }
+    if (ferror(fp) | fclose(fp)) {
+       out_printf("*** Error writing trace %s\n", path);
+       return -1;
+    }
+    out_printf("* Trace: %u frames written to %s (%u older ones lost)\n", hdr.count, path, hdr.lost);
+    return 0;
+}
+
+void replay_stop(void) {
+    if (replay.board == NULL) {
+       return;
+    }
+    ev_timer_stop(loop, &replay_timer);
+    replay.board->replaying = 0;
+
+    // the trace's commands whose replies we didn't get to won't get any now
+    struct board *was = brd;
+    brd = replay.board;
+    while (brd->cmdq.head != brd->cmdq.tail) {
+       struct at_cmd *cmd = &brd->cmdq.cmds[brd->cmdq.tail & (CMDQ_SIZE - 1)];
+       if (cmd->query && cmd->field >= 0) {
+          field_meta(cmd->chan, cmd->field)->pending = 0;
+       }
+       brd->cmdq.tail++;
+    }
+    brd->cmdq.inflight = 0;
+    cmdq_arm();
+    brd = was;
+
+    // the mirror now holds what the trace said, not what the board has:
+    // mark it all dirty so it's neither trusted nor saved in the snapshot
+    for (int i = 0; i < MAX_CHAN; i++) {
+       for (int f = 0; f < F_CHAN; f++) {
+          replay.board->chan_state[i].meta[f].dirty = 1;
+       }
+    }
+    for (int f = F_CHAN; f < F_MAX; f++) {
+       replay.board->meta[f].dirty = 1;
+    }
+    replay.board->cmdq.window = replay.window;
+    out_printf("* Replay: %u of %u frames in %.3f s\n", replay.done, replay.count, (mono_usec() - replay.started) / 1000000.0);
+    free(replay.data);
+    memset(&replay, 0, sizeof(replay));
+}
+
+// Feed every frame that's due, then sleep until the next one is
+static void replay_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    brd = replay.board;
+
+    while (replay.pos + sizeof(struct trace_rec) <= replay.len) {
+       struct trace_rec r;
+       char line[BUFFER_SIZE];
+
+       memcpy(&r, replay.data + replay.pos, sizeof(r));
+       if (r.len >= sizeof(line) || replay.pos + sizeof(r) + r.len > replay.len) {
+          out_printf("*** Trace is corrupt after %u frames\n", replay.done);
+          break;
+       }
+       if (replay.speed > 0) {
+          int64_t due = replay.started + (replay.at + r.usec) / replay.speed;
+          int64_t now = mono_usec();
+
+          if (due > now) {
+             ev_timer_set(w, (due - now) / 1000000.0, 0.);
+             ev_timer_start(loop, w);
+             return;
+          }
+       }
+       memcpy(line, replay.data + replay.pos + sizeof(r), r.len);
+       line[r.len] = '\0';
+       replay.at += r.usec;
+       replay.pos += sizeof(r) + r.len;
+       replay.done++;
+
+       // frames from the other boards in the trace aren't ours to replay
+       if (r.board != replay.board - boards && num_boards > 1) {
+          continue;
+       }
+       if (r.dir == 0) {
+          struct at_cmd cmd;
+
+          memset(&cmd, 0, sizeof(cmd));
+          snprintf(cmd.line, sizeof(cmd.line), "%.*s", (int)sizeof(cmd.line) - 1, line);
+          cmd.chan = brd->curr_chan;
+          cmd_prepare(&cmd);
+          cmdq_push(brd->fd, &cmd, CMD_REPLAY);
+          // what follows it was sent for the new channel, like c_chan() does
+          if (cmd.field == F_CHAN && !cmd.query) {
+             int chan = atoi(cmd.line + 11);
+             if (chan >= 1 && chan <= MAX_CHAN) {
+                brd->curr_chan = chan;
+             }
+          }
+       } else {
+          process_line(brd->fd, line);
+       }
+    }
+    replay_stop();
+}
+
+int replay_start(const char *path, double speed) {
+    struct trace_header hdr;
+    struct stat st;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL || fstat(fileno(fp), &st) < 0) {
+       int my_errno = errno;
+       out_printf("*** Error opening trace %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+       if (fp) {
+          fclose(fp);
+       }
+       return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC || hdr.size != sizeof(hdr)) {
+       out_printf("*** %s isn't a trace\n", path);
+       fclose(fp);
+       return -1;
+    }
+    replay.len = st.st_size - sizeof(hdr);
+    if ((replay.data = malloc(replay.len + 1)) == NULL) {
+       abort();
+    }
+    if (fread(replay.data, 1, replay.len, fp) != replay.len) {
+       out_printf("*** Error reading trace %s\n", path);
+       fclose(fp);
+       free(replay.data);
+       replay.data = NULL;
+       return -1;
+    }
+    fclose(fp);
+
+    // everything the trace had in flight can be in flight now
+    replay.board = brd;
+    replay.count = hdr.count;
+    replay.speed = speed;
+    replay.window = brd->cmdq.window;
+    replay.started = mono_usec();
+    brd->cmdq.window = CMDQ_SIZE;
+    brd->replaying = 1;
+    if (speed > 0) {
+       out_printf("* Replay: %u frames from %s on %s at %gx\n", hdr.count, path, brd->port, speed);
+    } else {
+       out_printf("* Replay: %u frames from %s on %s as fast as possible\n", hdr.count, path, brd->port);
+    }
+    replay_timer_cb(loop, &replay_timer, 0);
+    return 0;
+}
+
+// SIGUSR1 dumps the recorder without stopping anything
+static void trace_signal_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "freqgen-%d.trace", (int)getpid());
+    trace_dump(path);
+}
+
+void c_trace(int fd, char *argv[], int argc) {
+    if (argc == 0) {
+       unsigned long kept = (trace.head > TRACE_SIZE ? TRACE_SIZE : trace.head);
+       out_printf("* Trace: %lu frames recorded, last %lu kept%s\n", trace.head, kept,
+              (replay.board ? ", replaying" : ""));
+    } else if (strcasecmp(argv[0], "dump") == 0) {
+       char path[PATH_MAX];
+
+       if (argc > 1) {
+          snprintf(path, sizeof(path), "%s", argv[1]);
+       } else {
+          snprintf(path, sizeof(path), "freqgen-%d.trace", (int)getpid());
+       }
+       trace_dump(path);
+    } else if (strcasecmp(argv[0], "clear") == 0) {
+       trace.head = 0;
+    } else if (strcasecmp(argv[0], "stop") == 0) {
+       replay_stop();
+    } else if (strcasecmp(argv[0], "replay") == 0) {
+       double speed = 1;
+
+       if (argc < 2 || (argc > 2 && (parse_number(argv[2], &speed) < 0 || speed < 0))) {
+          out_printf("*** Usage: trace replay file [speed, 0 = as fast as possible]\n");
+          return;
+       }
+       if (replay.board) {
+          out_printf("*** Already replaying\n");
+          return;
+       }
+       if (!boards_idle()) {
+          out_printf("*** Board's busy, try again once it's answered\n");
+          return;
+       }
+       replay_start(argv[1], speed);
+    } else {
+       out_printf("*** Invalid argument %s to trace\n", argv[0]);
+    }
+}
+
+/////////////////////////////////////////////////
+void process_reply(int fd, const char *line, const char *cmd_line, int chan);
+
+// Parser benchmarks and fuzzing, for everything that turns text from a
+// person or the board into values. Each parser has a corpus of realistic
+// lines: 'bench parse' times them all (and checks against a baseline file,
+// or writes one) and 'bench fuzz' feeds them mutated lines, looking for
+// crashes, accepted values out of range and slow paths. Replies go to a
+// scratch board that never sends anything, and output's thrown away while
+// they run, so the real board's mirror isn't touched.
+#define	FUZZ_SLOW	100000		// ns, an input taking this long (best of 3) is a slow path
+#define	BENCH_SLOWER	1.25		// ns/op this much over the baseline is a regression
+#define	BENCH_TRIALS	11		// bench parse takes the median of this many runs
+
+static const char *corpus_hertz[] = {
+    "146.52m", "10000000", "10 kHz", "144.430M", "7.074mhz", "25000000hz", "1.5k", "200m", NULL
+};
+static const char *corpus_phase[] = { "0", "90", "90.0", "180.5", "359.9", "45", NULL };
+static const char *corpus_power[] = { "1023", "512", "50%", "100%", "12.3%", "0", NULL };
+static const char *corpus_command[] = {
+    "freq 146.52m", "power 50%", "chan 2 freq 10m", "board2 chan 1 power 100%", "phase 90 force",
+    "mode point", "sleep 500", "hsweep lin 1m 2m 100 5", "key cw 12 VVV DE N0CALL", "ref 25000000", NULL
+};
+static const char *corpus_reply[] = {
+    "+FRE=146520000", "OK", "+AMP=1023", "+PHA=4096", "+STARTAMP=0", "+TIME=10", "+SWEEP=OFF",
+    "+VERSION=V1.3", "+CHANNEL=2", "+MODE=POINT", "+MULT=20", "ERROR_DATA_OVER_RANGEM", NULL
+};
+
+struct script bench_script;
+struct board bench_board;
+
+// Each returns 0 if it took line (a copy it may chop up) with what it made of it in value
+static int bench_hertz(char *line, double *value) {
+    return parse_hertz(line, value);
+}
+
+// Not a parser: plain strtod() over the same lines, timed alongside them
+// to tell how fast the machine's running compared to the baseline
+static int bench_ref(char *line, double *value) {
+    *value = strtod(line, NULL);
+    return 0;
+}
+
+static int bench_phase(char *line, double *value) {
+    char err[128];
+    return script_parse_value(F_PHASE, line, value, err, sizeof(err));
+}
+
+static int bench_power(char *line, double *value) {
+    char err[128];
+    return script_parse_value(F_POWER, line, value, err, sizeof(err));
+}
+
+static int bench_command(char *line, double *value) {
+    char err[128];
+    int r;
+
+    bench_script.nops = 0;
+    bench_script.text_len = 0;
+    r = script_compile_line(&bench_script, line, 1, err, sizeof(err));
+    *value = bench_script.nops;
+    return r;
+}
+
+// process_line() without the queue (it's empty) and the output switching
+static int bench_reply(char *line, double *value) {
+    process_reply(-1, line, "(bench)", bench_board.curr_chan);
+    // forget anything it queued, the window's 0 so none of it went anywhere
+    bench_board.cmdq.head = bench_board.cmdq.tail;
+    *value = 0;
+    return 0;
+}
+
+struct parser_bench {
+    const char *name;
+    const char **corpus;
+    int (*parse)(char *line, double *value);
+    double lo, hi;		// an accepted value has to be in here
+    double ns;			// per op, from the last bench parse
+    double trials[BENCH_TRIALS];	// each run's, sorted
+} parsers[] = {
+    { "hertz",   corpus_hertz,   bench_hertz,   -HUGE_VAL, HUGE_VAL },
+    { "phase",   corpus_phase,   bench_phase,   0, 16383 },
+    { "power",   corpus_power,   bench_power,   0, 1023 },
+    { "command", corpus_command, bench_command, 0, 16 },
+    { "reply",   corpus_reply,   bench_reply,   0, 0 },
+    { NULL }
+}, parser_ref = { "ref", corpus_hertz, bench_ref };
+
+struct bench_saved {
+    struct board *brd;
+    FILE *out, *json_out;
+    int debug;
+} bench_saved;
+
+static void bench_enter(void) {
+    FILE *null = fopen("/dev/null", "w");
+
+    if (null == NULL) {
+       abort();
+    }
+    memset(&bench_board, 0, sizeof(bench_board));
+    bench_board.port = "bench";
+    bench_board.fd = -1;
+    bench_board.curr_chan = 1;
+    bench_board.cmdq.timeout = 1000;
+    bench_saved = (struct bench_saved){ brd, msg_out, json_out, debug };
+    brd = &bench_board;
+    fflush(msg_out);
+    msg_out = null;
+    json_out = NULL;
+    debug = 0;
+}
+
+static void bench_leave(void) {
+    fclose(msg_out);
+    msg_out = bench_saved.out;
+    brd = bench_saved.brd;
+    json_out = bench_saved.json_out;
+    debug = bench_saved.debug;
+    free(bench_script.ops);
+    free(bench_script.text);
+    memset(&bench_script, 0, sizeof(bench_script));
+}
+
+static int64_t mono_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// One run of p over its corpus, rounds times, into its (sorted) trials
+static void bench_trial(struct parser_bench *p, int rounds, int trial) {
+    char line[BUFFER_SIZE];
+    double v;
+    long ops = 0;
+    int64_t t0 = mono_nsec();
+
+    for (int r = 0; r < rounds; r++) {
+       for (const char **c = p->corpus; *c; c++, ops++) {
+          snprintf(line, sizeof(line), "%s", *c);
+          p->parse(line, &v);
+       }
+    }
+    double ns = (double)(mono_nsec() - t0) / ops;
+    int i = trial;
+    for (; i > 0 && p->trials[i - 1] > ns; i--) {
+       p->trials[i] = p->trials[i - 1];
+    }
+    p->trials[i] = ns;
+}
+
+// ns/op and lines/s for each parser over its corpus, the median of
+// BENCH_TRIALS runs (the best one is as much luck as anything). With a
+// baseline file, anything BENCH_SLOWER than it is called out, without one
+// it's written. How fast the machine is (shared, throttled) moves every
+// parser about as much as a regression would, so the baseline's scaled by
+// how parser_ref's time compares to the one saved with it.
+static void bench_parse(int rounds, const char *baseline) {
+    // a run of every parser per trial, so a busy spell slows them all alike
+    bench_enter();
+    for (int trial = 0; trial < BENCH_TRIALS; trial++) {
+       bench_trial(&parser_ref, rounds, trial);
+       for (struct parser_bench *p = parsers; p->name; p++) {
+          bench_trial(p, rounds, trial);
+       }
+    }
+    bench_leave();
+    parser_ref.ns = parser_ref.trials[BENCH_TRIALS / 2];
+    for (struct parser_bench *p = parsers; p->name; p++) {
+       p->ns = p->trials[BENCH_TRIALS / 2];
+    }
+
+    for (struct parser_bench *p = parsers; p->name; p++) {
+       out_printf("* Parse %-8s %8.1f ns/op %12.0f lines/s\n", p->name, p->ns, 1e9 / p->ns);
+    }
+    if (baseline == NULL) {
+       return;
+    }
+
+    FILE *fp = fopen(baseline, "r");
+    if (fp == NULL) {
+       if ((fp = fopen(baseline, "w")) == NULL) {
+          out_printf("*** Error creating %s: %s\n", baseline, strerror(errno));
+          return;
+       }
+       fprintf(fp, "%s %.1f\n", parser_ref.name, parser_ref.ns);
+       for (struct parser_bench *p = parsers; p->name; p++) {
+          fprintf(fp, "%s %.1f\n", p->name, p->ns);
+       }
+       fclose(fp);
+       out_printf("* Parse baseline saved to %s\n", baseline);
+       return;
+    }
+
+    char name[32];
+    double ns, base[sizeof(parsers) / sizeof(parsers[0])], speed = 1;
+    int slower = 0;
+
+    memset(base, 0, sizeof(base));
+    while (fscanf(fp, "%31s %lf", name, &ns) == 2) {
+       if (strcmp(name, parser_ref.name) == 0) {
+          speed = parser_ref.ns / ns;
+       }
+       for (int i = 0; parsers[i].name; i++) {
+          if (strcmp(parsers[i].name, name) == 0) {
+             base[i] = ns;
+          }
+       }
+    }
+    fclose(fp);
+    for (int i = 0; parsers[i].name; i++) {
+       struct parser_bench *p = &parsers[i];
+       if (base[i] > 0 && p->ns > base[i] * speed * BENCH_SLOWER) {
+          out_printf("*** Parse %s: %.1f ns/op is %.0f%% slower than the baseline %.1f (%.1f here)\n",
+                 p->name, p->ns, (p->ns / (base[i] * speed) - 1) * 100, base[i], base[i] * speed);
+          slower++;
+       }
+    }
+    if (!slower) {
+       out_printf("* Parse: no slower than %s (machine at %.2fx its speed then)\n", baseline, 1 / speed);
+    }
+}
+
+// xorshift64, so a seed gives the same inputs every time
+static uint64_t fuzz_state;
+
+static uint64_t fuzz_rand(void) {
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return fuzz_state;
+}
+
+// A line from any corpus, mangled a few ways
+static void fuzz_mutate(char *buf, size_t sz) {
+    static const char *tokens[] = {
+       "%", "nan", "inf", "1e309", "-", "=", "+", "k", "m", "hz", " ", "99999999999999999999",
+       "0x", ".", "force", "chan", "board9", "+FRE=", "ERROR", "\t"
+    };
+    int ncorpus = 0;
+    const char *corpus[64];
+
+    for (struct parser_bench *p = parsers; p->name; p++) {
+       for (const char **c = p->corpus; *c && ncorpus < 64; c++) {
+          corpus[ncorpus++] = *c;
+       }
+    }
+    snprintf(buf, sz, "%s", corpus[fuzz_rand() % ncorpus]);
+
+    for (int n = 1 + fuzz_rand() % 4; n > 0; n--) {
+       size_t len = strlen(buf), pos = (len ? fuzz_rand() % (len + 1) : 0);
+       const char *ins = NULL;
+       char byte[2] = { 1 + fuzz_rand() % 255, 0 };
+
+       switch (fuzz_rand() % 6) {
+          case 0:
+             if (len) {
+                buf[pos % len] = byte[0];
+             }
+             break;
+          case 1:
+             ins = byte;
+             break;
+          case 2:
+             if (pos < len) {
+                memmove(buf + pos, buf + pos + 1, len - pos);
+             }
+             break;
+          case 3:
+             ins = tokens[fuzz_rand() % (sizeof(tokens) / sizeof(tokens[0]))];
+             break;
+          case 4:
+             ins = corpus[fuzz_rand() % ncorpus];
+             break;
+          case 5: {
+             // doubled, as much as fits (len < sz, and the halves don't overlap)
+             size_t n = (len < sz - 1 - len ? len : sz - 1 - len);
+             memcpy(buf + len, buf, n);
+             buf[len + n] = '\0';
+             break;
+          }
+       }
+       if (ins && len + strlen(ins) < sz) {
+          memmove(buf + pos + strlen(ins), buf + pos, len - pos + 1);
+          memcpy(buf + pos, ins, strlen(ins));
+       }
+    }
+}
+
+// Print line with anything unprintable escaped
+static void fuzz_show(const char *line) {
+    for (const unsigned char *p = (const unsigned char *)line; *p; p++) {
+       out_printf((isprint(*p) && *p != '"' && *p != '\\') ? "%c" : "\\x%02x", *p);
+    }
+}
+
+static void bench_fuzz(long runs, uint64_t seed) {
+    char line[256], copy[256], worst[256] = "", bad[256] = "";
+    const char *worst_parser = "", *bad_parser = "";
+    unsigned long nbad = 0, slow = 0;
+    int64_t worst_ns = 0;
+    double bad_value = 0;
+    int nparsers = sizeof(parsers) / sizeof(parsers[0]) - 1;
+
+    fuzz_state = (seed ? seed : 1);
+    bench_enter();
+    for (long i = 0; i < runs; i++) {
+       struct parser_bench *p = &parsers[i % nparsers];
+       int64_t best = INT64_MAX;
+       double v = 0;
+       int r = 0;
+
+       fuzz_mutate(line, sizeof(line));
+       // a slow one gets 2 more goes, so it's not just a preemption
+       for (int tries = 0; tries < 3 && (best > FUZZ_SLOW || best > worst_ns); tries++) {
+          int64_t t0;
+          snprintf(copy, sizeof(copy), "%s", line);
+          t0 = mono_nsec();
+          r = p->parse(copy, &v);
+          if (mono_nsec() - t0 < best) {
+             best = mono_nsec() - t0;
+          }
+       }
+       if (best > FUZZ_SLOW) {
+          slow++;
+       }
+       if (best > worst_ns) {
+          worst_ns = best;
+          worst_parser = p->name;
+          snprintf(worst, sizeof(worst), "%s", line);
+       }
+       if (r == 0 && (!isfinite(v) || v < p->lo || v > p->hi)) {
+          if (nbad++ == 0) {
+             bad_parser = p->name;
+             bad_value = v;
+             snprintf(bad, sizeof(bad), "%s", line);
+          }
+       }
+    }
+    bench_leave();
+
+    out_printf("* Fuzz: %ld inputs (seed %llu), %lu bad values, %lu slow (over %d us), slowest %.1f us by %s: \"",
+           runs, (unsigned long long)(seed ? seed : 1), nbad, slow, FUZZ_SLOW / 1000, worst_ns / 1000.0, worst_parser);
+    fuzz_show(worst);
+    out_printf("\"\n");
+    if (nbad) {
+       out_printf("*** Fuzz: %s accepted \"", bad_parser);
+       fuzz_show(bad);
+       out_printf("\" as %g\n", bad_value);
+    }
+    if (slow) {
+       out_printf("*** Fuzz: %lu inputs took over %d us\n", slow, FUZZ_SLOW / 1000);
+    }
+}
+
+// The prefix chain process_reply() used to be, in its order, so 'bench'
+// has something to compare the hashed dispatch against
+static const char *bench_chain[] = {
+    "OK", "ERROR_DATA_OVER_RANGEM", "ERROR", "+AMP=", "+CHANNEL=", "+ENDFRE=", "+FRE=", "+MODE=",
+    "+MULT=", "+PHA=", "+REF=", "+ENDAMP=", "+STARTAMP=", "+STARTFRE=", "+STEP=", "+SWEEP=",
+    "+TIME=", "+VERSION=", NULL
+};
+
+void c_bench(int fd, char *argv[], int argc) {
+    static const char *replies[] = {
+       "+FRE=146520000", "OK", "+AMP=1023", "+PHA=4096", "+STARTAMP=0", "+TIME=10",
+       "+SWEEP=OFF", "+VERSION=V1.3", "+CHANNEL=2", "+MODE=POINT", "+ENDFRE=100", "ERROR_DATA_OVER_RANGEM"
+    };
+    static const char *commands[] = {
+       "freq", "power", "phase", "chan", "sweep", "window", "startfreq", "time", "mode", "load"
+    };
+    int nr = sizeof(replies) / sizeof(replies[0]), nc = sizeof(commands) / sizeof(commands[0]);
+    int rounds = (argc > 0 ? atoi(argv[0]) : 100000);
+    volatile long sink = 0;
+    int64_t t[5];
+
+    if (argc > 0 && strcasecmp(argv[0], "parse") == 0) {
+       rounds = (argc > 1 ? atoi(argv[1]) : 20000);
+       if (rounds < 1 || rounds > 100000000) {
+          out_printf("*** Invalid argument to bench parse: rounds [1-100000000]\n");
+          return;
+       }
+       bench_parse(rounds, (argc > 2 ? argv[2] : NULL));
+       return;
+    } else if (argc > 0 && strcasecmp(argv[0], "fuzz") == 0) {
+       long runs = (argc > 1 ? atol(argv[1]) : 100000);
+       if (runs < 1) {
+          out_printf("*** Invalid argument to bench fuzz: runs >= 1\n");
+          return;
+       }
+       bench_fuzz(runs, (argc > 2 ? strtoull(argv[2], NULL, 0) : 1));
+       return;
+    }
+
+    if (rounds < 1 || rounds > 100000000) {
+       out_printf("*** Invalid argument to bench: Value %d out of bounds [1-100000000]\n", rounds);
+       return;
+    }
+
+    t[0] = mono_usec();
+    for (int r = 0; r < rounds; r++) {
+       for (int i = 0; i < nr; i++) {
+          int j;
+          for (j = 0; bench_chain[j] && strncmp(replies[i], bench_chain[j], strlen(bench_chain[j])) != 0; j++) {
+          }
+          sink += j;
+       }
+    }
+    t[1] = mono_usec();
+    for (int r = 0; r < rounds; r++) {
+       for (int i = 0; i < nr; i++) {
+          const char *line = replies[i], *eq;
+          if (line[0] == '+' && (eq = strchr(line + 1, '=')) != NULL) {
+             sink += field_by_key(line + 1, eq - line - 1);
+          } else {
+             sink += (line[0] == 'O');
+          }
+       }
+    }
+    t[2] = mono_usec();
+    for (int r = 0; r < rounds; r++) {
+       for (int i = 0; i < nc; i++) {
+          int j;
+          for (j = 0; cons_cmds[j].name && strcasecmp(commands[i], cons_cmds[j].name) != 0; j++) {
+          }
+          sink += j;
+       }
+    }
+    t[3] = mono_usec();
+    for (int r = 0; r < rounds; r++) {
+       for (int i = 0; i < nc; i++) {
+          sink += (cmd_by_name(commands[i]) != NULL);
+       }
+    }
+    t[4] = mono_usec();
+
+    double nreply = (double)rounds * nr, ncmd = (double)rounds * nc;
+    out_printf("* Reply dispatch: %.0f lines/s by prefix chain, %.0f lines/s hashed\n",
+           nreply * 1e6 / (t[1] - t[0] + 1), nreply * 1e6 / (t[2] - t[1] + 1));
+    out_printf("* Command lookup: %.0f lines/s by linear scan, %.0f lines/s hashed\n",
+           ncmd * 1e6 / (t[3] - t[2] + 1), ncmd * 1e6 / (t[4] - t[3] + 1));
+}
+
+/////////////////////////////////////////////////
+// Calibration: time a few AT+VERSIONs one at a time for the turnaround,
+// then bursts of CAL_BURST at window 1, 2, 4 .. 64. A burst with anything
+// missing, wrong or ERROR ends it. The window kept is the smallest that
+// got within 5% of the best rate, and the timeout is 4x the worst reply
+// seen at it (50 ms at least). Input waits while it runs.
+struct calib {
+    struct board *board;	// being calibrated, one at a time (NULL for none)
+    int window;			// this step's (0 = measuring turnaround)
+    int sent, done, bad;
+    int64_t started, lat_max, lat_sum;
+    int best, limit, old_window;
+    double best_rate;
+    int64_t best_lat, rtt;
+} cal;
+
+void cal_finish(int fd);
+
+static void cal_step(int fd) {
+    struct at_cmd probe;
+
+    memset(&probe, 0, sizeof(probe));
+    snprintf(probe.line, sizeof(probe.line), "AT+VERSION");
+    probe.chan = brd->curr_chan;
+    cmd_prepare(&probe);
+
+    cal.sent = (cal.window ? CAL_BURST : CAL_BURST / 4);
+    cal.done = cal.bad = 0;
+    cal.lat_max = cal.lat_sum = 0;
+    brd->cmdq.window = (cal.window ? cal.window : 1);
+    cal.started = mono_usec();
+    for (int i = 0; i < cal.sent; i++) {
+       cmdq_push(fd, &probe, CMD_CAL);
+    }
+}
+
+// A probe was answered (or timed out, line is NULL)
+void cal_reply(int fd, const struct at_cmd *cmd, const char *line) {
+    if (line == NULL || strncmp(line, "+VERSION=", 9) != 0 || (brd->ver[0] && strcmp(line + 9, brd->ver) != 0)) {
+       cal.bad++;
+    } else {
+       int64_t usec = mono_usec() - cmd->sent;
+       cal.lat_sum += usec;
+       if (usec > cal.lat_max) {
+          cal.lat_max = usec;
+       }
+    }
+    if (++cal.done < cal.sent) {
+       return;
+    }
+
+    // that's the step done
+    int64_t took = mono_usec() - cal.started;
+    double rate = cal.done * 1000000.0 / (took > 0 ? took : 1);
+    int good = cal.done - cal.bad;
+
+    if (cal.window == 0) {
+       if (good == 0) {
+          out_printf("%s*** Calibration failed, the board isn't answering\n", board_tag());
+          cal_finish(fd);
+          return;
+       }
+       cal.rtt = cal.lat_sum / good;
+       out_printf("- Turnaround: %.2f ms (max %.2f)\n", cal.rtt / 1000.0, cal.lat_max / 1000.0);
+       cal.window = 1;
+       cal_step(fd);
+       return;
+    }
+    out_printf("- Window %2d: %7.0f cmds/s, slowest reply %.2f ms", cal.window, rate, cal.lat_max / 1000.0);
+    if (cal.bad > 0) {
+       out_printf(", %d of %d lost or wrong\n", cal.bad, cal.done);
+       cal.limit = cal.window;
+       cal_finish(fd);
+       return;
+    }
+    out_printf("\n");
+    if (rate > cal.best_rate * 1.05) {
+       cal.best = cal.window;
+       cal.best_rate = rate;
+       cal.best_lat = cal.lat_max;
+    }
+    if (cal.window >= 64) {
+       cal_finish(fd);
+       return;
+    }
+    cal.window *= 2;
+    cal_step(fd);
+}
+
+void pace_save(struct board *b);
+
+void cal_finish(int fd) {
+    struct pace *p = &brd->pace;
+
+    p->calibrating = 0;
+    cal.board = NULL;
+    if (cal.best == 0) {
+       brd->cmdq.window = cal.old_window;
+       return;
+    }
+    p->window = p->ceiling = brd->cmdq.window = cal.best;
+    p->rate = cal.best_rate;
+    p->rtt = cal.rtt;
+    p->limit = cal.limit;
+    p->timeout = cal.best_lat * 4 / 1000 + 1;
+    if (p->timeout < 50) {
+       p->timeout = 50;
+    }
+    brd->cmdq.timeout = p->timeout;
+    p->clean = 0;
+
+    out_printf("* %sCalibrated: %.0f cmds/s at window %d, timeout %d ms", board_tag(), p->rate, p->window, p->timeout);
+    if (p->limit) {
+       out_printf(" (loses replies at window %d)", p->limit);
+    }
+    out_printf("\n");
+    pace_save(brd);
+}
+
+void c_calibrate(int fd, char *argv[], int argc) {
+    if (cal.board) {
+       out_printf("*** Already calibrating %s\n", cal.board->port);
+       return;
+    }
+    // the bursts have to have the queue to themselves
+    if (!boards_idle()) {
+       out_printf("*** Board's busy, try again once it's answered\n");
+       return;
+    }
+    memset(&cal, 0, sizeof(cal));
+    cal.board = brd;
+    cal.old_window = brd->cmdq.window;
+    brd->pace.calibrating = 1;
+    out_printf("* %sCalibrating %s\n", board_tag(), brd->port);
+    cal_step(fd);
+}
+
+void c_board(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       int n = atoi(argv[0]);
+
+       // board2 and 2 both work
+       if (strncasecmp(argv[0], "board", 5) == 0) {
+          n = atoi(argv[0] + 5);
+       }
+       if (n < 1 || n > num_boards) {
+          out_printf("*** Invalid argument to board: Value %s out of bounds [1-%d]\n", argv[0], num_boards);
+          return;
+       }
+       sel_board = brd = &boards[n - 1];
+    }
+    for (int i = 0; i < num_boards; i++) {
+       struct board *b = &boards[i];
+       out_printf("* %cboard%d: %s ver %s, chan %d, %d in flight, %d waiting\n", (b == sel_board ? '>' : ' '),
+              i + 1, b->port, (b->ver[0] ? b->ver : "?"), b->curr_chan, b->cmdq.inflight, b->cmdq.head - b->cmdq.tail - b->cmdq.inflight);
+    }
+}
+
+void c_cache(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       if (strcasecmp(argv[0], "flush") == 0) {
+          // forget everything, next show/set goes to the board
+          for (int i = 0; i < MAX_CHAN; i++) {
+             for (int f = 0; f < F_CHAN; f++) {
+                brd->chan_state[i].meta[f].confirmed = 0;
+             }
+          }
+          for (int f = F_CHAN; f < F_MAX; f++) {
+             brd->meta[f].confirmed = 0;
+          }
+       } else if (strcasecmp(argv[0], "off") == 0) {
+          cache_ttl = 0;
+       } else {
+          int new_ttl = atoi(argv[0]);
+          if (new_ttl < 0 || new_ttl > 3600000) {
+             out_printf("*** Invalid argument to cache: Value %d out of bounds [0-3600000]\n", new_ttl);
+             return;
+          }
+          cache_ttl = new_ttl;
+       }
+    }
+    out_printf("* State cache: %s (%d ms), %lu shows answered, %lu sets skipped\n",
+           (cache_ttl > 0 ? "on" : "off"), cache_ttl, cache_hits, cache_skips);
+}
+
+void c_chan(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+        int new_chan = atoi(argv[0]);
+
+        if (new_chan < 1 || new_chan > MAX_CHAN) {
+           out_printf("*** Invalid argument to chan: Value %d out of bounds [1-%d]\n", new_chan, MAX_CHAN);
+           return;
+        }
+        if (cache_skip_set(F_CHAN, new_chan == brd->curr_chan)) {
+           return;
+        }
+        brd->curr_chan = new_chan;
+
+        if (debug) {
+           out_printf("Selecting channel %i\n", brd->curr_chan);
+        }
+        send_command(fd, "AT+CHANNEL+%i", brd->curr_chan);
+    } else if (cache_show(F_CHAN)) {
+        return;
+    }
+    query_field(fd, F_CHAN, argc > 0);
+
+    // catch up on whatever we don't know about the new channel
+    if (argc > 0 && refresh_policy == REFRESH_EAGER) {
+        chan_refresh(fd, brd->curr_chan);
+    }
+}
+
+void c_debug(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       int new_debug = atoi(argv[0]);
+       out_printf("* Changing debug level from %d to %d\n", debug, new_debug);
+       debug = new_debug;
+    } else {
+       out_printf("* Debug level: %d\n", debug);
+    }
+}
+
+void c_endfreq(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      double new_freq;
+      if (arg_value(F_END_FREQ, argv[0], &new_freq) < 0) {
+         return;
+      }
+      if (cache_skip_set(F_END_FREQ, brd->chan_state[brd->curr_chan-1].sweep_end_freq == new_freq)) {
+         return;
+      }
+      send_command(fd, "AT+ENDFRE+%.0f", new_freq);
+   } else if (cache_show(F_END_FREQ)) {
+      return;
+   }
+   query_field(fd, F_END_FREQ, argc > 0);
+}
+
+void c_endpower(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      double v;
+      if (arg_value(F_END_POWER, argv[0], &v) < 0) {
+         return;
+      }
+      int new_amp = v;
+      if (cache_skip_set(F_END_POWER, brd->chan_state[brd->curr_chan-1].sweep_end_power == new_amp)) {
+         return;
+      }
+      send_command(fd, "AT+ENDAMP+%d", new_amp);
+   } else if (cache_show(F_END_POWER)) {
+      return;
+   }
+   query_field(fd, F_END_POWER, argc > 0);
+}
+
+void c_freq(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+        double new_freq;
+
+        if (arg_value(F_FREQ, argv[0], &new_freq) < 0) {
+           return;
+        }
+        if (cache_skip_set(F_FREQ, brd->chan_state[brd->curr_chan-1].freq == new_freq)) {
+           return;
+        }
+        if (debug) {
+           out_printf("Setting channel %d frequency to %s\n", brd->curr_chan, argv[0]);
+        }
+        send_command(fd, "AT+FRE+%.0f", new_freq);
+    } else if (cache_show(F_FREQ)) {
+        return;
+    }
+    query_field(fd, F_FREQ, argc > 0);
+}
+
+void c_help(int fd, char *argv[], int argc) {
+    struct cmds *c;
+    out_printf("****\n");
+    out_printf("AD9959 controller help:\n");
+    out_printf("Frequencies can be specified human friendly (ex: 146.52m)\n");
+    out_printf("Power levels can be given as percent (ex: 90.0%%)\n");
+    out_printf("Phase angles shall be given as degrees (ex: 90.0)\n");
+    out_printf("* name\tmin/max args\tDescription\n");
+    int i = 0;
+    while (i < 100) {
+       c = &cons_cmds[i];
+
+       // is this the last record?
+       if (c->func == NULL && c->min_args == 0 && c->max_args == 0) {
+          break;
+       }
+       out_printf("%s\t\t%d, %d\t%s\n", c->name, c->min_args, c->max_args, c->msg);
+       i++;
+    }
+    out_printf("****\n");
+}
+
+void c_info(int fd, char *argv[], int argc) {
+    c_version(fd, NULL, 0);
+    c_ref(fd, NULL, 0);
+    c_mult(fd, NULL, 0);
+    c_chan(fd, NULL, 0);
+
+    // clear starting flag
+    starting_up = 0;
+}
+
+void c_load(int fd, char *argv[], int argc) {
+    // Load a configuration from a file
+    if (argc > 0) {
+       struct script *s = script_load(argv[0]);
+       if (s != NULL) {
+          script_start(s);
+       }
+    } else {
+       out_printf("*** No script file name give!\n");
+    }
+}
+
+void c_mode(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+        char *mode = strdup(argv[0]);
+        if (!mode) {
+           abort();
+        }
+        uppercase(mode);
+        if (cache_skip_set(F_MODE, strcmp(brd->chan_state[brd->curr_chan-1].mode, mode) == 0)) {
+           free(mode);
+           return;
+        }
+        if (debug) {
+           out_printf("Setting channel %d mode to %s\n", brd->curr_chan, mode);
+        }
+        send_command(fd, "AT+MODE+%s", mode);
+        free(mode);
+    } else if (cache_show(F_MODE)) {
+        return;
+    }
+    query_field(fd, F_MODE, argc > 0);
+}
+
+void c_mult(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_MULT, argv[0], &v) < 0) {
+          return;
+       }
+       int new_mult = v;
+       if (cache_skip_set(F_MULT, brd->clk_mult == new_mult)) {
+          return;
+       }
+       out_printf("* Setting mult to %d Hz\n", new_mult);
+       send_command(fd, "AT+MULT+%d", new_mult);
+    } else if (cache_show(F_MULT)) {
+       return;
+    }
+    query_field(fd, F_MULT, argc > 0);
+}
+
+void c_phase(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_PHASE, argv[0], &v) < 0) {
+          return;
+       }
+       int new_phase = v;
+       double new_angle = convertPhaseToAngle(new_phase);
+       if (cache_skip_set(F_PHASE, brd->chan_state[brd->curr_chan-1].phase == new_phase)) {
+          return;
+       }
+       out_printf("- Chan %d changing phase to %.1f (%d)\n", brd->curr_chan, new_angle, new_phase);
+       send_command(fd, "AT+PHA+%d", new_phase);
+    } else if (cache_show(F_PHASE)) {
+       return;
+    }
+    query_field(fd, F_PHASE, argc > 0);
+}
+
+void c_power(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_POWER, argv[0], &v) < 0) {
+          return;
+       }
+       int new_amp = v;
+       if (cache_skip_set(F_POWER, brd->chan_state[brd->curr_chan-1].power == new_amp)) {
+          return;
+       }
+       send_command(fd, "AT+AMP+%d", new_amp);
+    } else if (cache_show(F_POWER)) {
+       return;
+    }
+    query_field(fd, F_POWER, argc > 0);
+}
+
+void c_quit(int fd, char *argv[], int argc) {
+   // a client just hangs up, once its commands have been answered
+   if (cur_client) {
+      cur_client->closing = 1;
+      return;
+   }
+   // let anything still in flight finish first
+   quit_when_idle("Goodbye!");
+}
+
+void c_ref(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_REF, argv[0], &v) < 0) {
+          return;
+       }
+       int refclk = v;
+       if (cache_skip_set(F_REF, brd->ref_clk == refclk)) {
+          return;
+       }
+       out_printf("* Setting refclk to %d Hz\n", refclk);
+       send_command(fd, "AT+REF+%d", refclk);
+    } else if (cache_show(F_REF)) {
+       return;
+    }
+    query_field(fd, F_REF, argc > 0);
+}
+
+void c_refresh(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       int i;
+
+       if (strcasecmp(argv[0], "now") == 0) {
+          // re-read everything about the current channel
+          for (int f = 0; f < F_CHAN; f++) {
+             brd->chan_state[brd->curr_chan-1].meta[f].dirty = 1;
+          }
+          chan_refresh(fd, brd->curr_chan);
+          return;
+       }
+
+       for (i = 0; i < 3; i++) {
+          if (strcasecmp(argv[0], refresh_names[i]) == 0) {
+             break;
+          }
+       }
+       if (i == 3) {
+          out_printf("*** Invalid argument %s to refresh\n", argv[0]);
+          return;
+       }
+       refresh_policy = i;
+    }
+    out_printf("* Refresh policy: %s\n", refresh_names[refresh_policy]);
+}
+
+void c_reset(int fd, char *argv[], int argc) {
+    send_command_noreply(fd, "AT+RESET");
+    quit_when_idle("* Resetting board. Goodbye!");
+}
+
+void c_restore(int fd, char *argv[], int argc) {
+    if (strcasecmp(argv[0], "CONFIRM") != 0) {
+       out_printf("Please add CONFIRM to the command line, if sure!\n");
+       return;
+    }
+    send_command_noreply(fd, "AT+RESTORE");
+    quit_when_idle("* Sending factory reset to board. Goodbye!");
+}
+
+void c_save(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      save_config(argv[0]);
+   } else {
+      out_printf("*** You must specify a file to SAVE to!\n");
+   }
+}
+
+void c_sleep(int fd, char *argv[], int argc) {
+   int sleepms = atoi(argv[0]);
+   // limit to 1ms to 60 seconds
+   if (sleepms <= 0 || sleepms > MAX_SLEEP) {
+      out_printf("invalid sleep time %s limit [0-%d] ms\n", argv[0], MAX_SLEEP);
+      return;
+   }
+   sleep_start(sleepms);
+}
+
+static const char *cmd_type_name(int f) {
+    return (f < F_MAX ? fields[f].key : "other");
+}
+
+void stats_json(FILE *fp) {
+    int first = 1;
+
+    fprintf(fp, "{\"port\": ");
+    json_string(fp, brd->port);
+    fprintf(fp, ", \"tx\": {\"commands\": %lu, \"bytes\": %lu, \"writes\": %lu, \"max_batch\": %lu}, ",
+            brd->tx.frames, brd->tx.bytes, brd->tx.flushes, brd->tx.max_batch);
+    fprintf(fp, "\"rx\": {\"lines\": %lu, \"bytes\": %lu, \"reads\": %lu, \"ioctls\": %lu}, ",
+            brd->rx.lines, brd->rx.bytes, brd->rx.reads, brd->rx.ioctls);
+    fprintf(fp, "\"queue\": {\"completed\": %lu, \"errors\": %lu, \"timeouts\": %lu, \"stray\": %lu}, ",
+            brd->cmdq.completed, brd->cmdq.errors, brd->cmdq.timeouts, brd->cmdq.stray);
+    fprintf(fp, "\"cache\": {\"hits\": %lu, \"skips\": %lu}, \"commands\": [", cache_hits, cache_skips);
+    for (int f = 0; f <= F_MAX; f++) {
+       for (int q = 0; q < 2; q++) {
+          struct lat_stats *ls = &brd->cmd_stats[f][q];
+          if (ls->count == 0 && ls->timeouts == 0) {
+             continue;
+          }
+          fprintf(fp, "%s{\"cmd\": \"%s\", \"type\": \"%s\", \"count\": %lu, \"errors\": %lu, \"timeouts\": %lu, "
+                  "\"avg_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+                  (first ? "" : ", "), cmd_type_name(f), (q ? "query" : "set"), ls->count, ls->errors, ls->timeouts,
+                  (ls->count ? ls->sum / 1000.0 / ls->count : 0.0), lat_quantile(ls, 0.5) / 1000.0,
+                  lat_quantile(ls, 0.99) / 1000.0, ls->max / 1000.0);
+          first = 0;
+       }
+    }
+    fprintf(fp, "]}\n");
+}
+
+void c_stats(int fd, char *argv[], int argc) {
+    static const char *bucket_names[] = { "1", "2", "3-4", "5-8", "9-16", "17-32", "33+" };
+
+    if (argc > 0 && strcasecmp(argv[0], "reset") == 0) {
+       memset(brd->cmd_stats, 0, sizeof(brd->cmd_stats));
+       brd->tx.flushes = brd->tx.frames = brd->tx.bytes = brd->tx.max_batch = 0;
+       memset(brd->tx.hist, 0, sizeof(brd->tx.hist));
+       brd->rx.reads = brd->rx.ioctls = brd->rx.bytes = brd->rx.lines = 0;
+       brd->cmdq.completed = brd->cmdq.errors = brd->cmdq.timeouts = brd->cmdq.stray = 0;
+       cache_hits = cache_skips = 0;
+       out_printf("* %sStatistics reset\n", board_tag());
+       return;
+    } else if (argc > 0 && strcasecmp(argv[0], "json") == 0) {
+       FILE *fp = msg_out;
+
+       if (argc > 1 && (fp = fopen(argv[1], "w")) == NULL) {
+          int my_errno = errno;
+          out_printf("*** Error opening %s: %d (%s)\n", argv[1], my_errno, strerror(my_errno));
+          return;
+       }
+       stats_json(fp);
+       if (fp != msg_out) {
+          fclose(fp);
+       }
+       return;
+    } else if (argc > 0) {
+       out_printf("*** Invalid argument %s to stats\n", argv[0]);
+       return;
+    }
+
+    if (num_boards > 1) {
+       out_printf("* Board %s\n", brd->port);
+    }
+    out_printf("* TX: %lu commands, %lu bytes in %lu writes (%.2f commands/write, max %lu)\n",
+           brd->tx.frames, brd->tx.bytes, brd->tx.flushes,
+           (brd->tx.flushes ? (double)brd->tx.frames / brd->tx.flushes : 0.0), brd->tx.max_batch);
+    out_printf("* TX commands per write:");
+    for (int i = 0; i < 7; i++) {
+       out_printf(" %s:%lu", bucket_names[i], brd->tx.hist[i]);
+    }
+    out_printf("\n");
+    out_printf("* RX: %lu lines, %lu bytes in %lu reads (+%lu FIONREAD)\n",
+           brd->rx.lines, brd->rx.bytes, brd->rx.reads, brd->rx.ioctls);
+    out_printf("* Input (%s): %lu lines, %lu bytes in %lu reads\n", (input_tty ? "terminal" : "bulk"),
+           stdin_rx.lines, stdin_rx.bytes, stdin_rx.reads);
+    out_printf("* Queue: %lu completed, %lu errors, %lu timeouts, %lu stray replies\n",
+           brd->cmdq.completed, brd->cmdq.errors, brd->cmdq.timeouts, brd->cmdq.stray);
+    out_printf("* Cache: %lu shows answered, %lu sets skipped\n", cache_hits, cache_skips);
+
+    out_printf("* Latency\tcount\terrors\ttimeout\tavg\tp50\tp99\tmax (ms)\n");
+    for (int f = 0; f <= F_MAX; f++) {
+       for (int q = 0; q < 2; q++) {
+          struct lat_stats *ls = &brd->cmd_stats[f][q];
+          if (ls->count == 0 && ls->timeouts == 0) {
+             continue;
+          }
+          out_printf("* %s%s\t%lu\t%lu\t%lu\t%.2f\t%.2f\t%.2f\t%.2f\n", cmd_type_name(f), (q ? "?" : "="),
+                 ls->count, ls->errors, ls->timeouts, (ls->count ? ls->sum / 1000.0 / ls->count : 0.0),
+                 lat_quantile(ls, 0.5) / 1000.0, lat_quantile(ls, 0.99) / 1000.0, ls->max / 1000.0);
+       }
+    }
+}
+
+void c_startfreq(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      double new_freq;
+      if (arg_value(F_START_FREQ, argv[0], &new_freq) < 0) {
+         return;
+      }
+      if (cache_skip_set(F_START_FREQ, brd->chan_state[brd->curr_chan-1].sweep_start_freq == new_freq)) {
+         return;
+      }
+      send_command(fd, "AT+STARTFRE+%.0f", new_freq);
+   } else if (cache_show(F_START_FREQ)) {
+      return;
+   }
+   query_field(fd, F_START_FREQ, argc > 0);
+}
+
+void c_startpower(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      double v;
+      if (arg_value(F_START_POWER, argv[0], &v) < 0) {
+         return;
+      }
+      int new_amp = v;
+      if (cache_skip_set(F_START_POWER, brd->chan_state[brd->curr_chan-1].sweep_start_power == new_amp)) {
+         return;
+      }
+      send_command(fd, "AT+STARTAMP+%d", new_amp);
+   } else if (cache_show(F_START_POWER)) {
+      return;
+   }
+   query_field(fd, F_START_POWER, argc > 0);
+}
+
+void c_step(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_STEP, argv[0], &v) < 0) {
+          return;
+       }
+       int new_step = v;
+       if (cache_skip_set(F_STEP, brd->chan_state[brd->curr_chan-1].sweep_step == new_step)) {
+          return;
+       }
+       send_command(fd, "AT+STEP+%d", new_step);
+    } else if (cache_show(F_STEP)) {
+       return;
+    }
+   query_field(fd, F_STEP, argc > 0);
+}
+
+void c_sweep(int fd, char *argv[], int argc) {
+   if (argc > 0) {
+      int new_state;
+      if (strncasecmp(argv[0], "OFF", 3) == 0) {
+         new_state = 0;
+      } else if (strncasecmp(argv[0], "ON", 2) == 0) {
+         new_state = 1;
+      } else {
+         out_printf("*** Invalid argument %s to SWEEP\n", argv[0]);
+         return;
+      }
+      if (cache_skip_set(F_SWEEP, brd->chan_state[brd->curr_chan-1].sweep_active == new_state)) {
+         return;
+      }
+      if (debug) {
+         out_printf("- Chan %d %sabling SWEEP\n", brd->curr_chan, (new_state ? "en" : "dis"));
+      }
+      send_command(fd, "AT+SWEEP+%s", (new_state ? "ON" : "OFF"));
+   } else if (cache_show(F_SWEEP)) {
+      return;
+   }
+   query_field(fd, F_SWEEP, argc > 0);
+}
+
+void c_time(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       double v;
+       if (arg_value(F_TIME, argv[0], &v) < 0) {
+          return;
+       }
+       int new_time = v;
+       if (cache_skip_set(F_TIME, brd->chan_state[brd->curr_chan-1].sweep_time == new_time)) {
+          return;
+       }
+       send_command(fd, "AT+TIME+%d", new_time);
+    } else if (cache_show(F_TIME)) {
+       return;
+    }
+    query_field(fd, F_TIME, argc > 0);
+}
+
+void c_timeout(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       int new_timeout = atoi(argv[0]);
+       if (new_timeout < 1 || new_timeout > 60000) {
+          out_printf("*** Invalid argument to timeout: Value %d out of bounds [1-60000]\n", new_timeout);
+          return;
+       }
+       brd->cmdq.timeout = new_timeout;
+    }
+    out_printf("* Reply timeout: %d ms\n", brd->cmdq.timeout);
 }
 
 void c_version(int fd, char *argv[], int argc) {
+    if (cache_show(F_VERSION)) {
+       return;
+    }
+    send_command(fd, "AT+VERSION");
+}
+
+void c_window(int fd, char *argv[], int argc) {
+    if (argc > 0) {
+       int new_window = atoi(argv[0]);
+       if (new_window < 1 || new_window > 64) {
+          out_printf("*** Invalid argument to window: Value %d out of bounds [1-64]\n", new_window);
+          return;
+       }
+       brd->cmdq.window = brd->pace.ceiling = new_window;
+       brd->pace.clean = 0;
+       cmdq_kick(fd);
+    }
+    out_printf("* Command window: %d (%u in flight, %d waiting, %lu done, %lu errors, %lu timeouts)\n",
+           brd->cmdq.window, brd->cmdq.inflight, cmdq_waiting(), brd->cmdq.completed, brd->cmdq.errors, brd->cmdq.timeouts);
+    if (brd->pace.window > 0 || brd->pace.backoffs > 0) {
+       out_printf("* Pacing: up to %d, %lu backoffs", brd->pace.ceiling, brd->pace.backoffs);
+       if (brd->pace.window > 0) {
+          out_printf(", calibrated %d at %.0f cmds/s, turnaround %.2f ms", brd->pace.window, brd->pace.rate, brd->pace.rtt / 1000.0);
+       }
+       out_printf("\n");
+    }
+}
+
+void process_reply(int fd, const char *line, const char *cmd_line, int chan);
+
+void process_line(int fd, const char *line) {
+    if (debug) {
+       out_printf("ser_read: %s\n", line);
+    }
+
+    // figure out which command this answers (if any)
+    struct at_cmd *cmd = cmdq_reply(fd, line);
+    const char *cmd_line = (cmd ? cmd->line : "(unsolicited)");
+
+    // what it says goes to whoever sent the command, as does anything it sets off
+    if (cmd && cmd->client) {
+       client_enter(client_by_id(cmd->client));
+    }
+
+    // calibration probes are only timed, not shown
+    if (cmd && (cmd->flags & CMD_CAL)) {
+       cal_reply(fd, cmd, line);
+       client_enter(NULL);
+       return;
+    }
+
+    // the board acts on commands in order, so a reply belongs to whichever
+    // channel was selected when its command was queued
+    process_reply(fd, line, cmd_line, (cmd ? cmd->chan : brd->curr_chan));
+
+    // with no readbacks, a set's OK is all the confirmation we get
+    if (cmd && !cmd->query && cmd->field >= 0 && refresh_policy == REFRESH_NEVER &&
+        strncmp(line, "OK", 2) == 0) {
+       char setline[sizeof(cmd->line) + 2];
+       snprintf(setline, sizeof(setline), "+%s=%s", cmd->key, cmd->line + 3 + strlen(cmd->key) + 1);
+       process_reply(fd, setline, cmd->line, cmd->chan);
+    }
+    client_enter(NULL);
+
+    // the last probe reply is in, see if the snapshot holds up
+    if (cmd && (cmd->flags & CMD_PROBE_END)) {
+       snapshot_check(fd);
+    }
+}
+
+/////////////////////////////////////////////////
+// Reply handlers. A +KEY=value line is split once, KEY is looked up in
+// reply_hash and value handed to the field's handler from reply_routes[].
+void reply_int(int fd, int chan, int f, const char *value);
+void reply_hz(int fd, int chan, int f, const char *value);
+void reply_sweep_amp(int fd, int chan, int f, const char *value);
+void reply_mode(int fd, int chan, int f, const char *value);
+void reply_sweep(int fd, int chan, int f, const char *value);
+void reply_chan(int fd, int chan, int f, const char *value);
+void reply_ref(int fd, int chan, int f, const char *value);
+void reply_mult(int fd, int chan, int f, const char *value);
+void reply_version(int fd, int chan, int f, const char *value);
+
+struct reply_route {
+    void (*handler)(int fd, int chan, int f, const char *value);
+    size_t off;			// reply_int/hz/sweep_amp: where it lives in ChannelState
+} reply_routes[F_MAX] = {
+    [F_MODE] =        { reply_mode },
+    [F_FREQ] =        { reply_hz,        offsetof(struct ChannelState, freq) },
+    [F_PHASE] =       { reply_int,       offsetof(struct ChannelState, phase) },
+    [F_POWER] =       { reply_int,       offsetof(struct ChannelState, power) },
+    [F_START_FREQ] =  { reply_hz,        offsetof(struct ChannelState, sweep_start_freq) },
+    [F_END_FREQ] =    { reply_hz,        offsetof(struct ChannelState, sweep_end_freq) },
+    [F_START_POWER] = { reply_sweep_amp, offsetof(struct ChannelState, sweep_start_power) },
+    [F_END_POWER] =   { reply_sweep_amp, offsetof(struct ChannelState, sweep_end_power) },
+    [F_STEP] =        { reply_hz,        offsetof(struct ChannelState, sweep_step) },
+    [F_TIME] =        { reply_int,       offsetof(struct ChannelState, sweep_time) },
+    [F_SWEEP] =       { reply_sweep },
+    [F_CHAN] =        { reply_chan },
+    [F_REF] =         { reply_ref },
+    [F_MULT] =        { reply_mult },
+    [F_VERSION] =     { reply_version },
+};
+
+#define	CHAN_FIELD(chan, f, type) ((type *)((char *)&brd->chan_state[(chan)-1] + reply_routes[f].off))
+
+void reply_int(int fd, int chan, int f, const char *value) {
+    *CHAN_FIELD(chan, f, int) = atoi(value);
+    field_confirm(chan, f);
+    show_field(chan, f);
+}
+
+void reply_hz(int fd, int chan, int f, const char *value) {
+    *CHAN_FIELD(chan, f, double) = atoi(value);
+    field_confirm(chan, f);
+    show_field(chan, f);
+}
+
+void reply_sweep_amp(int fd, int chan, int f, const char *value) {
+    int *amp = CHAN_FIELD(chan, f, int);
+    int new_amp = atoi(value);
+
+    if (new_amp != *amp) {
+       out_printf("%s- Chan %d SWEEP %s Power: %d (%.1f%%) (was %d)\n", board_tag(), chan, (f == F_START_POWER ? "Start" : "End"),
+              new_amp, convertAmplitudeToPower(new_amp), *amp);
+       *amp = new_amp;
+    } else {
+       show_field(chan, f);
+    }
+    field_confirm(chan, f);
+}
+
+void reply_mode(int fd, int chan, int f, const char *new_mode) {
+    size_t msz = sizeof(brd->chan_state[chan-1].mode);
+
+    // a different mode means everything else we knew about the channel is suspect
+    if (brd->chan_state[chan-1].meta[F_MODE].confirmed != 0 && strcasecmp(brd->chan_state[chan-1].mode, new_mode) != 0) {
+       for (int f = 0; f < F_CHAN; f++) {
+          brd->chan_state[chan-1].meta[f].dirty = 1;
+       }
+    }
+
+    // zero buffer and save mode for this channel
+    memset(brd->chan_state[chan-1].mode, 0, msz);
+    snprintf(brd->chan_state[chan-1].mode, msz, "%s", new_mode);
+    field_confirm(chan, F_MODE);
+    show_field(chan, F_MODE);
+
+    if (strcasecmp(new_mode, "SWEEP") == 0 || strcasecmp(new_mode, "POINT") == 0) {
+       if (refresh_policy == REFRESH_EAGER) {
+          chan_refresh_fields(fd, chan);
+       }
+    } else {
+       // FSK2, FSK4, AM
+       out_printf("%s*** Unsupported mode: %s\n", board_tag(), new_mode);
+    }
+}
+
+void reply_sweep(int fd, int chan, int f, const char *value) {
+    if (strncasecmp(value, "OFF", 3) == 0) {
+       brd->chan_state[chan-1].sweep_active = 0;
+    } else if (strncasecmp(value, "ON", 2) == 0) {
+       brd->chan_state[chan-1].sweep_active = 1;
+    } else {
+       out_printf("%sUnknown sweep state (chan#%d): +SWEEP=%s\n", board_tag(), chan, value);
+       return;
+    }
+    field_confirm(chan, F_SWEEP);
+    show_field(chan, F_SWEEP);
+}
+
+void reply_chan(int fd, int chan, int f, const char *value) {
+    int new_chan = atoi(value);
+    if (new_chan < 1 || new_chan > MAX_CHAN) {
+       out_printf("%s*** Board reports invalid channel %d\n", board_tag(), new_chan);
+       return;
+    }
+    if (debug && new_chan != chan) {
+       out_printf("%sBoard is on chan %d, expected chan %d\n", board_tag(), new_chan, chan);
+    }
+    // adopt the board's channel, unless commands queued since then assume ours
+    if (brd->cmdq.head == brd->cmdq.tail) {
+       brd->curr_chan = new_chan;
+    }
+    chan = new_chan;
+    field_confirm(chan, F_CHAN);
+    show_field(chan, F_CHAN);
+    if (brd->probing) {
+       // the snapshot has the rest, if it's right
+       brd->probe_chan = new_chan;
+    } else if (refresh_policy == REFRESH_EAGER) {
+       chan_refresh(fd, chan);
+    }
+}
+
+void reply_ref(int fd, int chan, int f, const char *value) {
+    int tmp_refclk = atoi(value);
+    if (tmp_refclk > 0) {
+       if (tmp_refclk != brd->ref_clk) {
+          out_printf("%s* ClkRef: changed from %d to %d\n", board_tag(), brd->ref_clk, tmp_refclk);
+          brd->ref_clk = tmp_refclk;
+       } else {
+          out_printf("%s* ClkRef: %d Hz\n", board_tag(), brd->ref_clk);
+       }
+       field_confirm(chan, F_REF);
+       if (json_out) {
+          json_field(chan, F_REF);
+       }
+    }
+}
+
+void reply_mult(int fd, int chan, int f, const char *value) {
+    int tmp_mult = atoi(value);
+    if (tmp_mult < 1 || tmp_mult > 20) {
+       out_printf("%s*** Invalid mult argument data: Out of range! Last command was not succesful (MULT)!\n", board_tag());
+       return;
+    }
+    if (tmp_mult != brd->clk_mult) {
+       out_printf("%s* Multiplier: changed from %d to %d\n", board_tag(), brd->clk_mult, tmp_mult);
+       brd->clk_mult = tmp_mult;
+    } else {
+       out_printf("%s* Multiplier: %d\n", board_tag(), brd->clk_mult);
+    }
+    field_confirm(chan, F_MULT);
+    if (json_out) {
+       json_field(chan, F_MULT);
+    }
+}
+
+void reply_version(int fd, int chan, int f, const char *value) {
+    memset(brd->ver, 0, sizeof(brd->ver));
+    snprintf(brd->ver, sizeof(brd->ver), "%s", value);
+    field_confirm(chan, F_VERSION);
+    show_field(chan, F_VERSION);
+}
+
+void process_reply(int fd, const char *line, const char *cmd_line, int chan) {
+    if (line[0] == '+') {
+       // capture state messages
+       const char *eq = strchr(line + 1, '=');
+       int f = (eq ? field_by_key(line + 1, eq - line - 1) : -1);
+
+       if (f >= 0) {
+          reply_routes[f].handler(fd, chan, f, eq + 1);
+          return;
+       }
+    } else if (strncmp(line, "OK", 2) == 0) {
+       if (debug) {
+          out_printf("OK! (%s)\n", cmd_line);
+       }
+       return;
+    } else if (strncmp(line, "ERROR", 5) == 0) {
+       if (json_out) {
+          json_event("error", cmd_line, line);
+       }
+       if (strcmp(line, "ERROR_DATA_OVER_RANGEM") == 0) {
+          out_printf("%s*** %s: Invalid argument data: Out of range! Command was not successful!\n", board_tag(), cmd_line);
+       } else {
+          out_printf("%s*** %s: Command failed: %s\n", board_tag(), cmd_line, line);
+       }
+       return;
+    }
+    if (json_out) {
+       json_event("unknown", NULL, line);
+    }
+    out_printf("%sUnknown response (chan#%d): %s\n", board_tag(), chan, line);
+}
+
+/////////////////////////////////////////////////
+// State snapshots (<port>.state, next to the lockfile)
+
+// <port>.lock, <port>.state etc. in the current directory
+void port_file(const char *port, const char *ext, char *path, size_t pathsz) {
+    // Find the position of the last '/' in the port path
+    const char *last_slash_position = strrchr(port, '/');
+
+    // use what's after it, or the whole path if there isn't one
+    snprintf(path, pathsz, "%s%s", (last_slash_position ? last_slash_position + 1 : port), ext);
+}
+
+static uint32_t snapshot_sum(const struct snapshot *s) {
+    const unsigned char *p = (const unsigned char *)s;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < offsetof(struct snapshot, sum); i++) {
+       h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Copy per channel field f from src to dst
+static void chan_field_copy(struct ChannelState *dst, const struct ChannelState *src, int f) {
+    if (f == F_MODE) {
+       memcpy(dst->mode, src->mode, sizeof(dst->mode));
+    } else if (f == F_SWEEP) {
+       dst->sweep_active = src->sweep_active;
+    } else {
+       size_t len = (reply_routes[f].handler == reply_hz ? sizeof(double) : sizeof(int));
+       memcpy((char *)dst + reply_routes[f].off, (const char *)src + reply_routes[f].off, len);
+    }
+}
+
+// Read b's snapshot into b->snap. Returns 0 if there isn't a good one.
+int snapshot_load(struct board *b) {
+    char path[PATH_MAX];
+    struct snapshot *s = &b->snap;
+    FILE *fp;
+    size_t n;
+
+    port_file(b->port, ".state", path, sizeof(path));
+    if ((fp = fopen(path, "rb")) == NULL) {
+       return 0;
+    }
+    n = fread(s, 1, sizeof(*s), fp);
+    fclose(fp);
+
+    if (n != sizeof(*s) || s->magic != SNAP_MAGIC || s->size != sizeof(*s) || s->sum != snapshot_sum(s) ||
+        strncmp(s->port, b->port, sizeof(s->port)) != 0 || s->curr_chan < 1 || s->curr_chan > MAX_CHAN) {
+       out_printf("* %sIgnoring bad snapshot %s\n", board_tag(), path);
+       memset(s, 0, sizeof(*s));
+       return 0;
+    }
+    for (int i = 0; i < MAX_CHAN; i++) {
+       s->chan_state[i].mode[sizeof(s->chan_state[i].mode) - 1] = '\0';
+    }
+    s->ver[sizeof(s->ver) - 1] = '\0';
+    b->snap_loaded = 1;
+    return 1;
+}
+
+// Save what we know of b, on top of what the snapshot we loaded knew (if we kept it)
+void snapshot_save(struct board *b) {
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+    struct snapshot s;
+    FILE *fp;
+
+    if (b->snap_loaded) {
+       s = b->snap;
+    } else {
+       memset(&s, 0, sizeof(s));
+    }
+    s.magic = SNAP_MAGIC;
+    s.size = sizeof(s);
+    snprintf(s.port, sizeof(s.port), "%s", b->port);
+
+    for (int i = 0; i < MAX_CHAN; i++) {
+       for (int f = 0; f < F_CHAN; f++) {
+          struct field_meta *m = &b->chan_state[i].meta[f];
+
+          if (m->confirmed && !m->dirty) {
+             chan_field_copy(&s.chan_state[i], &b->chan_state[i], f);
+             s.chan_state[i].meta[f].confirmed = 1;
+          } else if (m->dirty) {
+             // we changed it and never saw what it ended up as
+             s.chan_state[i].meta[f].confirmed = 0;
+          }
+          s.chan_state[i].meta[f].dirty = s.chan_state[i].meta[f].pending = 0;
+       }
+    }
+    for (int f = F_CHAN; f < F_MAX; f++) {
+       if (b->meta[f].confirmed && !b->meta[f].dirty) {
+          switch (f) {
+             case F_CHAN: s.curr_chan = b->curr_chan; break;
+             case F_REF: s.ref_clk = b->ref_clk; break;
+             case F_MULT: s.clk_mult = b->clk_mult; break;
+             case F_VERSION: memcpy(s.ver, b->ver, sizeof(s.ver)); break;
+          }
+          s.meta[f].confirmed = 1;
+       }
+       s.meta[f].dirty = s.meta[f].pending = 0;
+    }
+    // nothing worth keeping
+    if (!s.meta[F_VERSION].confirmed || !s.meta[F_CHAN].confirmed) {
+       return;
+    }
+    s.sum = snapshot_sum(&s);
+
+    // written aside and renamed, so a crash never leaves half of one
+    port_file(b->port, ".state", path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "wb")) == NULL || fwrite(&s, sizeof(s), 1, fp) != 1 || fclose(fp) != 0 ||
+        rename(tmp, path) < 0) {
+       int my_errno = errno;
+       out_printf("*** Error saving snapshot %s: %d (%s)\n", path, my_errno, strerror(my_errno));
+    }
+}
+
+// Ask the board just enough to tell if the snapshot's still right: version,
+// channel and that channel's frequency, all in one round trip
+void snapshot_probe(int fd) {
+    // nothing's assumed about the board until it's answered: the channel
+    // first, and the frequency (on that channel) once we know it's the one
+    brd->probing = 1;
+    brd->probe_chan = 0;
     send_command(fd, "AT+VERSION");
+    query_field(fd, F_CHAN, 0);
+    brd->cmdq.cmds[(brd->cmdq.head - 1) & (CMDQ_SIZE - 1)].flags |= CMD_PROBE_END;
+}
+
+// A step of the probe's done: ask for the frequency, take the snapshot or start over
+void snapshot_check(int fd) {
+    struct snapshot *s = &brd->snap;
+    struct ChannelState *cs = &brd->chan_state[s->curr_chan - 1];
+    int check_freq = s->chan_state[s->curr_chan - 1].meta[F_FREQ].confirmed;
+    int64_t now = mono_usec();
+
+    if (brd->probing == 1 && check_freq && strcmp(brd->ver, s->ver) == 0 && brd->probe_chan == s->curr_chan) {
+       // the board's on the snapshot's channel, so its frequency reply lands on the right one
+       brd->probing = 2;
+       brd->curr_chan = brd->probe_chan;
+       query_field(fd, F_FREQ, 0);
+       brd->cmdq.cmds[(brd->cmdq.head - 1) & (CMDQ_SIZE - 1)].flags |= CMD_PROBE_END;
+       return;
+    }
+
+    brd->probing = 0;
+    if (strcmp(brd->ver, s->ver) != 0 || brd->probe_chan != s->curr_chan ||
+        (check_freq && cs->freq != s->chan_state[s->curr_chan - 1].freq)) {
+       out_printf("* %sBoard doesn't match its snapshot, reading everything\n", board_tag());
+       if (debug) {
+          out_printf("snapshot: ver %s/%s chan %d/%d freq %.0f/%.0f\n", brd->ver, s->ver, brd->probe_chan, s->curr_chan,
+                 cs->freq, s->chan_state[s->curr_chan - 1].freq);
+       }
+       memset(s, 0, sizeof(*s));
+       brd->snap_loaded = 0;
+       c_info(fd, NULL, 0);
+       return;
+    }
+
+    memcpy(brd->chan_state, s->chan_state, sizeof(brd->chan_state));
+    for (int i = 0; i < MAX_CHAN; i++) {
+       for (int f = 0; f < F_CHAN; f++) {
+          brd->chan_state[i].meta[f].confirmed = (brd->chan_state[i].meta[f].confirmed ? now : 0);
+       }
+    }
+    if (s->meta[F_REF].confirmed) {
+       brd->ref_clk = s->ref_clk;
+       field_confirm(0, F_REF);
+    }
+    if (s->meta[F_MULT].confirmed) {
+       brd->clk_mult = s->clk_mult;
+       field_confirm(0, F_MULT);
+    }
+    brd->curr_chan = s->curr_chan;
+    out_printf("* %sState restored from snapshot (chan %d, mode %s)\n", board_tag(), brd->curr_chan,
+           (cs->mode[0] ? cs->mode : "unknown"));
+}
+
+/////////////////////////////////////////////////
+// Pacing profiles (<port>.pace): what calibrate found, as "key value" lines
+void pace_save(struct board *b) {
+    char path[PATH_MAX];
+    FILE *fp;
+
+    port_file(b->port, ".pace", path, sizeof(path));
+    if ((fp = fopen(path, "w")) == NULL) {
+       out_printf("*** Can't save %s: %s\n", path, strerror(errno));
+       return;
+    }
+    fprintf(fp, "window %d\ntimeout %d\nlimit %d\nturnaround %lld\nrate %.0f\n", b->pace.window, b->pace.timeout,
+            b->pace.limit, (long long)b->pace.rtt, b->pace.rate);
+    fclose(fp);
+    out_printf("* %sPacing saved to %s\n", board_tag(), path);
+}
+
+// Use b's profile, if it's been calibrated
+void pace_load(struct board *b) {
+    char path[PATH_MAX], key[16];
+    double value;
+    FILE *fp;
+
+    b->pace.ceiling = b->cmdq.window;
+    port_file(b->port, ".pace", path, sizeof(path));
+    if ((fp = fopen(path, "r")) == NULL) {
+       return;
+    }
+    while (fscanf(fp, "%15s %lf", key, &value) == 2) {
+       if (strcmp(key, "window") == 0) {
+          b->pace.window = value;
+       } else if (strcmp(key, "timeout") == 0) {
+          b->pace.timeout = value;
+       } else if (strcmp(key, "limit") == 0) {
+          b->pace.limit = value;
+       } else if (strcmp(key, "turnaround") == 0) {
+          b->pace.rtt = value;
+       } else if (strcmp(key, "rate") == 0) {
+          b->pace.rate = value;
+       }
+    }
+    fclose(fp);
+
+    if (b->pace.window < 1 || b->pace.window > 64 || b->pace.timeout < 1 || b->pace.timeout > 60000) {
+       out_printf("* Ignoring bad pacing profile %s\n", path);
+       memset(&b->pace, 0, sizeof(b->pace));
+       b->pace.ceiling = b->cmdq.window;
+       return;
+    }
+    if (!cmdq_window_set) {
+       b->cmdq.window = b->pace.ceiling = b->pace.window;
+    }
+    b->cmdq.timeout = b->pace.timeout;
+    if (!exec_mode) {
+       out_printf("* Pacing from %s: window %d, timeout %d ms\n", path, b->cmdq.window, b->cmdq.timeout);
+    }
+}
+
+int boards_probing(void) {
+    for (int i = 0; i < num_boards; i++) {
+       if (boards[i].probing || boards[i].pace.calibrating) {
+          return 1;
+       }
+    }
+    return 0;
+}
+
+// Read everything the port has for us into the ring, returns bytes read,
+// 0 on EOF or -1 on error (errno set)
+ssize_t ring_fill(struct line_ring *r, int fd) {
+    ssize_t total = 0;
+
+    while (1) {
+        size_t used = r->head - r->tail;
+        size_t space = RING_SIZE - used;
+        size_t pos = r->head & (RING_SIZE - 1);
+        struct iovec iov[2];
+        int iovcnt = 1;
+        int avail = 0;
+
+        if (space == 0) {
+            break;
+        }
+
+        // free space may wrap around the end of the buffer
+        iov[0].iov_base = r->data + pos;
+        iov[0].iov_len = RING_SIZE - pos;
+        if (iov[0].iov_len >= space) {
+            iov[0].iov_len = space;
+        } else {
+            iov[1].iov_base = r->data;
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        ssize_t nbytes = readv(fd, iov, iovcnt);
+        r->reads++;
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return (total > 0 ? total : -1);
+        } else if (nbytes == 0) {
+            return total;
+        }
+        r->head += nbytes;
+        r->bytes += nbytes;
+        total += nbytes;
+
+        // anything more arrive while we were reading?
+        r->ioctls++;
+        if (ioctl(fd, FIONREAD, &avail) != 0 || avail <= 0) {
+            break;
+        }
+    }
+    return total;
+}
+
+// Copy the next complete line out of the ring into line (NUL terminated).
+// Returns the line length, or -1 if no complete line is buffered. If the
+// ring is full (or the line won't fit in line), the pending bytes are
+// returned as a line of their own rather than thrown away.
+int ring_getline(struct line_ring *r, char *line, size_t linesz) {
+    while (1) {
+        // skip line endings left over from the previous line (\r\n pairs)
+        while (r->tail != r->head) {
+            char c = r->data[r->tail & (RING_SIZE - 1)];
+            if (c != '\r' && c != '\n') {
+                break;
+            }
+            r->tail++;
+        }
+        if (r->scan < r->tail) {
+            r->scan = r->tail;
+        }
+
+        while (r->scan != r->head) {
+            char c = r->data[r->scan & (RING_SIZE - 1)];
+            if (c == '\r' || c == '\n') {
+                break;
+            }
+            if (r->scan - r->tail >= linesz - 1) {
+                break;
+            }
+            r->scan++;
+        }
+
+        size_t len = r->scan - r->tail;
+        int complete = 0;
+
+        if (r->scan != r->head) {
+            char c = r->data[r->scan & (RING_SIZE - 1)];
+            complete = (c == '\r' || c == '\n');
+        }
+
+        if (!complete) {
+            if (len < (linesz - 1) && (r->head - r->tail) < RING_SIZE) {
+                // partial line, wait for more data
+                return -1;
+            }
+            out_printf("overflow! (splitting %zu byte line)\n", len);
+        }
+
+        for (size_t i = 0; i < len; i++) {
+            line[i] = r->data[(r->tail + i) & (RING_SIZE - 1)];
+        }
+        line[len] = '\0';
+        r->tail = r->scan;
+
+        if (len > 0) {
+            r->lines++;
+            return len;
+        }
+    }
+}
+
+// The next line, as ring_getline() would give it, but left in the ring
+int ring_peekline(struct line_ring *r, char *line, size_t linesz) {
+    size_t tail = r->tail, scan = r->scan;
+    unsigned long lines = r->lines;
+    int len = ring_getline(r, line, linesz);
+
+    r->tail = tail;
+    r->scan = scan;
+    r->lines = lines;
+    return len;
+}
+
+// While a trace replays, input from r waits, as anything it sent would be
+// mixed in with the replay. Only trace gets through, so it can be stopped.
+int replay_holds(struct line_ring *r) {
+    char line[BUFFER_SIZE], *save = NULL, *tok;
+    struct cmds *c;
+
+    if (replay.board == NULL) {
+       return 0;
+    }
+    if (ring_peekline(r, line, sizeof(line)) < 0) {
+       return 1;
+    }
+    if ((tok = strtok_r(line, " \t\r\n", &save)) != NULL && board_by_name(tok) != NULL) {
+       tok = strtok_r(NULL, " \t\r\n", &save);
+    }
+    return (tok != NULL && ((c = cmd_by_name(tok)) == NULL || c->func != c_trace));
+}
+
+void serial_read_cb(int fd) {
+    char line[BUFFER_SIZE];
+    ssize_t nbytes = ring_fill(&brd->rx, fd);
+
+    if (nbytes < 0) {
+        int my_errno = errno;
+        out_printf("*** Error reading serial port: %d:%s\n", my_errno, strerror(my_errno));
+        exit(EXIT_FAILURE);
+    } else if (nbytes == 0) {
+        out_printf("*** Serial port %s closed\n", brd->port);
+        exit(EXIT_FAILURE);
+    }
+
+    // hand off every complete line we've got in one go
+    int64_t now = mono_usec();
+    int len;
+    while ((len = ring_getline(&brd->rx, line, sizeof(line))) >= 0) {
+        trace_record(1, line, len, now);
+        process_line(fd, line);
+    }
+}
+
+/////////////////////////////////////////////////
+// Daemon mode: we own the port(s) and take commands from any number of
+// clients on a unix (and/or localhost tcp) socket. Their lines go into the
+// same queue as the console's, in the order they arrive.
+int daemon_mode(void) {
+    return (listen_fds[0] >= 0 || listen_fds[1] >= 0);
 }
 
-void process_line(int fd, const char *line) {
+struct client *client_by_id(int id) {
+    for (struct client *c = clients; c != NULL; c = c->next) {
+       if (c->id == id) {
+          return c;
+       }
+    }
+    return NULL;
+}
+
+static void client_tx_cb(struct ev_loop *loop, ev_io *w, int revents);
+
+// Send what we can of c's output without blocking, returns -1 if it's gone
+int client_flush(struct client *c) {
+    fflush(c->out);
+
+    while (c->osent < c->olen) {
+       ssize_t n = send(c->fd, c->obuf + c->osent, c->olen - c->osent, MSG_NOSIGNAL);
+
+       if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+       } else if (n < 0 && errno == EINTR) {
+          continue;
+       } else if (n <= 0) {
+          c->closing = 1;
+          c->osent = c->olen;
+          break;
+       }
+       c->osent += n;
+    }
+
+    if (c->osent == c->olen) {
+       // all gone, start the buffer over
+       rewind(c->out);
+       fflush(c->out);
+       c->osent = 0;
+       ev_io_stop(loop, &c->tx_watcher);
+    } else if (c->olen - c->osent > CLIENT_MAX_OUT) {
+       out_printf("*** Client %d isn't reading its output, dropping it\n", c->id);
+       c->closing = 1;
+       c->pending = 0;
+       c->osent = c->olen;
+       return -1;
+    } else {
+       ev_io_start(loop, &c->tx_watcher);
+    }
+    return 0;
+}
+
+// Send out_printf()s to c from here on (NULL for the console)
+void client_enter(struct client *c) {
+    if (c == cur_client && msg_out == (c ? c->out : cons_out)) {
+       return;
+    }
+    fflush(msg_out);
+    if (cur_client) {
+       client_flush(cur_client);
+    }
+    cur_client = c;
+    msg_out = (c ? c->out : cons_out);
+}
+
+void client_close(struct client *c) {
+    struct client **pp = &clients;
+
+    if (cur_client == c) {
+       client_enter(NULL);
+    }
+    // the last thing it gets, so -x (or anyone) can tell how it went without reading the rest
+    fprintf(c->out, "%s %d errors, %d timeouts\n", CLIENT_DONE, c->errors, c->timeouts);
+    client_flush(c);
     if (debug) {
-       printf("ser_read: %s\n", line);
+       out_printf("* Client %d disconnected\n", c->id);
     }
+    while (*pp != c) {
+       pp = &(*pp)->next;
+    }
+    *pp = c->next;
+    num_clients--;
 
-    // XXX: Deal with errors and tracking status from query_device_info commands
-    if (strncmp(line, "OK", 2) == 0) {
-       if (debug) {
-          printf("OK!\n");
-       }
-    } else if (strcmp(line, "ERROR_DATA_OVER_RANGEM") == 0) {
-       printf("*** Invalid argument data: Out of range! Last command was not successful!\n");
-    // capture state messages
-    } else if (strncmp(line, "+AMP=", 5) == 0) {
-       int new_amp = atoi(line+5);
-       chan_state[curr_chan-1].power = new_amp;
-       printf("- Chan %d power: %d (%.1f%%)\n", curr_chan, new_amp, convertAmplitudeToPower(new_amp));
-    } else if (strncmp(line, "+CHANNEL=", 9) == 0) {
-       curr_chan = atoi(line + 9);
-       printf("* Chan %d selected\n", curr_chan);
-       // query channel parameters to cause an update in struct
-       c_mode(fd, NULL, 0);
-    } else if (strncmp(line, "+ENDFRE=", 8) == 0) {
-       chan_state[curr_chan-1].sweep_end_freq = atoi(line+8);
-       printf("- Chan %d sweep end freq: %.0f\n", curr_chan, chan_state[curr_chan-1].sweep_end_freq);
-    } else if (strncmp(line, "+FRE=", 5) == 0) {
-       chan_state[curr_chan-1].freq = atoi(line + 5);
-
-       printf("- Chan %d freq: %.0f\n", curr_chan, chan_state[curr_chan-1].freq);
-    } else if (strncmp(line, "+MODE=", 6) == 0) {
-       const char *new_mode = line + 6;
-       size_t msz = sizeof(chan_state[curr_chan-1].mode);
-
-       // zero buffer and save mode for this channel
-       memset(chan_state[curr_chan-1].mode, 0, msz);
-       snprintf(chan_state[curr_chan-1].mode, msz, "%s", new_mode);
-       printf("- Chan %d mode: %s\n", curr_chan, chan_state[curr_chan-1].mode);
-
-       if (strcasecmp(new_mode, "SWEEP") == 0) {
-          // query sweep parameters
-          c_startpower(fd, NULL, 0);
-          c_endpower(fd, NULL, 0);
-          c_startfreq(fd, NULL, 0);
-          c_endfreq(fd, NULL, 0);
-          c_time(fd, NULL, 0);
-          c_step(fd, NULL, 0);
-          c_sweep(fd, NULL, 0);
-       } else if (strcasecmp(new_mode, "POINT") == 0) {
-          c_freq(fd, NULL, 0);
-          c_phase(fd, NULL, 0);
-          c_power(fd, NULL, 0);
-       } else if (strcasecmp(new_mode, "FSK2") == 0) {
-          printf("*** Unsupported mode: %s\n", new_mode);
-          return;
-       } else if (strcasecmp(new_mode, "FSK4") == 0) {
-          printf("*** Unsupported mode: %s\n", new_mode);
-          return;
-       } else if (strcasecmp(new_mode, "AM") == 0) {
-          printf("*** Unsupported mode: %s\n", new_mode);
-          return;
-       }
-    } else if (strncmp(line, "+MULT=", 6) == 0) {
-       int tmp_mult = atoi(line+6);
-       if (tmp_mult < 1 || tmp_mult > 20) {
-          printf("*** Invalid mult argument data: Out of range! Last command was not succesful (MULT)!\n");
-          return;
-       }
-       if (tmp_mult != clk_mult) {
-          printf("* Multiplier: changed from %d to %d\n", clk_mult, tmp_mult);
-          clk_mult = tmp_mult;
-       } else {
-          printf("* Multiplier: %d\n", clk_mult);
+    ev_io_stop(loop, &c->watcher);
+    ev_io_stop(loop, &c->tx_watcher);
+    ev_timer_stop(loop, &c->sleep_timer);
+    fclose(c->out);
+    free(c->obuf);
+    close(c->fd);
+    free(c);
+}
+
+// Run c's buffered lines until it runs out, sleeps or the queues back up
+void client_run(struct client *c) {
+    char line[BUFFER_SIZE];
+    struct board *console_board = sel_board;
+
+    client_enter(c);
+    sel_board = c->board;
+    while (!ev_is_active(&c->sleep_timer) && !c->closing && boards_backlog() < CMDQ_SIZE / 2 && !boards_probing()) {
+       brd = sel_board;
+       if (replay_holds(&c->rx) || ring_getline(&c->rx, line, sizeof(line)) < 0) {
+          break;
        }
-    } else if (strncmp(line, "+PHA=", 5) == 0) {
-       int new_phase = atoi(line + 5);
-       double new_angle = convertPhaseToAngle(new_phase);
-       chan_state[curr_chan-1].phase  = new_phase;
-       printf("- Chan %d phase: %d (%.1f deg)\n", curr_chan, chan_state[curr_chan-1].phase, new_angle);
-    } else if (strncmp(line, "+REF=", 5) == 0) {
-       int tmp_refclk = atoi(line+5);
-       if (tmp_refclk > 0) {
-          if (tmp_refclk != ref_clk) {
-             printf("* ClkRef: changed from %d to %d\n", ref_clk, tmp_refclk);
-             ref_clk = tmp_refclk;
-          } else {
-             printf("* ClkRef: %d Hz\n", ref_clk);
-          }
+       handle_command(brd->fd, line);
+    }
+    c->board = sel_board;
+    sel_board = brd = console_board;
+    client_enter(NULL);
+
+    if (c->eof && c->rx.head == c->rx.tail && !ev_is_active(&c->sleep_timer)) {
+       // hung up, finish what it sent then let it go
+       c->closing = 1;
+    } else if (!c->eof && !ev_is_active(&c->watcher) && (c->rx.head - c->rx.tail) < RING_SIZE) {
+       ev_io_start(loop, &c->watcher);
+    }
+}
+
+// Close clients that are done, and pick up ones that were held back
+void clients_prepare(void) {
+    struct client *c = clients, *next;
+
+    for (; c != NULL; c = next) {
+       next = c->next;
+       if (c->closing && c->pending <= 0) {
+          client_close(c);
+       } else if (c->rx.head != c->rx.tail && !c->closing) {
+          client_run(c);
        }
-    } else if (strncmp(line, "+ENDAMP=", 8) == 0) {
-       int new_amp = atoi(line+8);
-       if (new_amp != chan_state[curr_chan-1].sweep_end_power) {
-          printf("- Chan %d SWEEP End Power: %d (%.1f%%) (was %d)\n", curr_chan, new_amp, convertAmplitudeToPower(new_amp), chan_state[curr_chan-1].sweep_end_power);
-          chan_state[curr_chan-1].sweep_end_power = new_amp;
-       } else {
-          printf("- Chan %d SWEEP End Power: %d\n", curr_chan, new_amp);
+    }
+}
+
+static void client_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    struct client *c = w->data;
+    ssize_t nbytes = ring_fill(&c->rx, w->fd);
+
+    if (nbytes <= 0 && (nbytes == 0 || (errno != EAGAIN && errno != EINTR))) {
+       // terminate any partial last line so it still gets run
+       if (c->rx.head != c->rx.tail && (c->rx.head - c->rx.tail) < RING_SIZE) {
+          c->rx.data[c->rx.head++ & (RING_SIZE - 1)] = '\n';
        }
-    } else if (strncmp(line, "+STARTAMP=", 10) == 0) {
-       int new_amp = atoi(line+10);
-       if (new_amp != chan_state[curr_chan-1].sweep_start_power) {
-          printf("- Chan %d SWEEP Start Power: %d (%.1f%%) (was %d)\n", curr_chan, new_amp, convertAmplitudeToPower(new_amp), chan_state[curr_chan-1].sweep_start_power);
-          chan_state[curr_chan-1].sweep_start_power = new_amp;
-       } else {
-          printf("- Chan %d SWEEP Start Power: %d (%.1f%%)\n", curr_chan, new_amp, convertAmplitudeToPower(new_amp));
-       }
-    } else if (strncmp(line, "+STARTFRE=", 10) == 0) {
-       chan_state[curr_chan-1].sweep_start_freq = atoi(line+10);
-       printf("- Chan %d sweep start freq: %.0f\n", curr_chan, chan_state[curr_chan-1].sweep_start_freq);
-    } else if (strncmp(line, "+STEP=", 6) == 0) {
-       chan_state[curr_chan-1].sweep_step = atoi(line+6);
-       printf("- Chan %d sweep step: %.0f\n", curr_chan, chan_state[curr_chan-1].sweep_step);
-    } else if (strncmp(line, "+SWEEP=", 7) == 0) {
-       if (strncasecmp(line+7, "OFF", 3) == 0) {
-          chan_state[curr_chan-1].sweep_active = 0;
-          printf("- Chan %d sweep inactive\n", curr_chan);
-       } else if (strncasecmp(line+7, "ON", 2) == 0) {
-          chan_state[curr_chan-1].sweep_active = 1;
-          printf("- Chan %d sweep ACTIVE\n", curr_chan);
-       }
-    } else if (strncmp(line, "+TIME=", 6) == 0) {
-       chan_state[curr_chan-1].sweep_time = atoi(line+6);
-       printf("- Chan %d sweep time: %d\n", curr_chan, chan_state[curr_chan-1].sweep_time);
-    } else if (strncmp(line, "+VERSION=", 9) == 0) {
-       memset(brd_ver, 0, sizeof(brd_ver));
-       snprintf(brd_ver, sizeof(brd_ver), "%s", line + 9);
-       printf("* Connected to board version %s\n", brd_ver);
-    } else {
-       printf("Unknown response (chan#%d): %s\n", curr_chan, line);
+       c->eof = 1;
+       ev_io_stop(loop, w);
+    } else if ((c->rx.head - c->rx.tail) >= RING_SIZE) {
+       ev_io_stop(loop, w);
     }
+    client_run(c);
 }
 
-void serial_read_cb(int fd) {
-    static char read_buffer[BUFFER_SIZE];
-    static int buffer_index = 0;
-    char c;
-    ssize_t nbytes = read(fd, &c, 1);
-    if (nbytes > 0) {
-        if (c == '\r' || c == '\n') {
-            if (buffer_index > 0) {
-                read_buffer[buffer_index] = '\0'; 	// Null-terminate the string
-                process_line(fd, read_buffer);
-                buffer_index = 0;
-            }
-        } else {
-            if (buffer_index < BUFFER_SIZE - 1) {
-                read_buffer[buffer_index++] = c;
-            } else {
-                printf("overflow!\n");
-            }
-        }
+static void client_tx_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    client_flush(w->data);
+}
+
+static void client_sleep_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    client_run(w->data);
+}
+
+static void listen_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    int fd = accept(w->fd, NULL, NULL);
+    int one = 1;
+    static int next_id = 1;
+    struct client *c;
+
+    if (fd < 0) {
+       return;
+    }
+    if (num_clients >= MAX_CLIENTS) {
+       out_printf("*** Too many clients (%d), refusing another\n", MAX_CLIENTS);
+       close(fd);
+       return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (w == &listen_watchers[1]) {
+       // replies are small, don't let them sit waiting for more
+       setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if ((c = calloc(1, sizeof(*c))) == NULL ||
+        (c->out = open_memstream(&c->obuf, &c->olen)) == NULL) {
+       free(c);
+       close(fd);
+       return;
+    }
+    c->id = next_id++;
+    c->fd = fd;
+    c->board = sel_board;
+    ev_io_init(&c->watcher, client_read_cb, fd, EV_READ);
+    c->watcher.data = c;
+    ev_io_start(loop, &c->watcher);
+    ev_io_init(&c->tx_watcher, client_tx_cb, fd, EV_WRITE);
+    c->tx_watcher.data = c;
+    ev_timer_init(&c->sleep_timer, client_sleep_cb, 0., 0.);
+    c->sleep_timer.data = c;
+    c->next = clients;
+    clients = c;
+    num_clients++;
+
+    if (debug) {
+       out_printf("* Client %d connected\n", c->id);
+    }
+}
+
+static void daemon_cleanup(void) {
+    if (daemon_path && listen_fds[0] >= 0) {
+       unlink(daemon_path);
+    }
+}
+
+// Start listening for clients on daemon_path and/or localhost:daemon_tcp
+void daemon_start(void) {
+
+    if (daemon_path) {
+       struct sockaddr_un sa;
+       struct stat st;
+       int fd;
+
+       memset(&sa, 0, sizeof(sa));
+       sa.sun_family = AF_UNIX;
+       if (strlen(daemon_path) >= sizeof(sa.sun_path)) {
+          fprintf(stderr, "Socket path %s is too long\n", daemon_path);
+          exit(EXIT_FAILURE);
+       }
+       strcpy(sa.sun_path, daemon_path);
+
+       if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+          perror("socket");
+          exit(EXIT_FAILURE);
+       }
+       // a socket left behind by a daemon that died is cleared away, a live one means we're not needed
+       if (lstat(daemon_path, &st) == 0) {
+          if (!S_ISSOCK(st.st_mode)) {
+             fprintf(stderr, "%s exists and isn't a socket\n", daemon_path);
+             exit(EXIT_FAILURE);
+          }
+          if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+             fprintf(stderr, "Another daemon is already listening on %s\n", daemon_path);
+             exit(EXIT_FAILURE);
+          }
+          close(fd);
+          unlink(daemon_path);
+          fd = socket(AF_UNIX, SOCK_STREAM, 0);
+       }
+       if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0) {
+          fprintf(stderr, "Can't listen on %s: %s\n", daemon_path, strerror(errno));
+          exit(EXIT_FAILURE);
+       }
+       listen_fds[0] = fd;
+       atexit(daemon_cleanup);
+       out_printf("* Listening on %s\n", daemon_path);
+    }
+
+    if (daemon_tcp) {
+       struct sockaddr_in sa;
+       int one = 1;
+       int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+       memset(&sa, 0, sizeof(sa));
+       sa.sin_family = AF_INET;
+       sa.sin_port = htons(daemon_tcp);
+       sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+       setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+       if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0) {
+          fprintf(stderr, "Can't listen on 127.0.0.1:%d: %s\n", daemon_tcp, strerror(errno));
+          exit(EXIT_FAILURE);
+       }
+       listen_fds[1] = fd;
+       out_printf("* Listening on 127.0.0.1:%d\n", daemon_tcp);
+    }
+
+    for (int i = 0; i < 2; i++) {
+       if (listen_fds[i] >= 0) {
+          fcntl(listen_fds[i], F_SETFL, fcntl(listen_fds[i], F_GETFL) | O_NONBLOCK);
+          ev_io_init(&listen_watchers[i], listen_cb, listen_fds[i], EV_READ);
+          ev_io_start(loop, &listen_watchers[i]);
+       }
     }
+
+    // nothing else can change the boards behind our back, so what we've seen stays good
+    cache_ttl = 3600000;
 }
 
 void handle_command(int fd, const char *input) {
@@ -706,101 +6042,366 @@ void handle_command(int fd, const char *input) {
         return;
     }
 
-    // iterate over all the known commands
-    int i = 0;
-    while (cons_cmds[i].name != NULL) {
-        if (strcasecmp(command, cons_cmds[i].name) == 0) {
-            char *args[MAX_ARGS];
-            int num_args = 0;
-            char *arg = strtok(NULL, " \t\r\n");
-
-            while (arg != NULL && num_args < MAX_ARGS) {
-                args[num_args++] = arg;
-                arg = strtok(NULL, " \t\r\n");
-            }
-
-            if (num_args < cons_cmds[i].min_args || num_args > cons_cmds[i].max_args) {
-                printf("Usage: %s %s\n", cons_cmds[i].name, cons_cmds[i].msg);
-            } else {
-                cons_cmds[i].func(fd, args, num_args);
-            }
+    // boardN in front sends the rest of the line to that board
+    struct board *b = board_by_name(command);
+    if (b != NULL) {
+        brd = b;
+        fd = brd->fd;
+        if ((command = strtok(NULL, " \t\r\n")) == NULL) {
+            out_printf("* %s (%s) chan %d\n", b == sel_board ? "Selected board" : "Board", brd->port, brd->curr_chan);
             return;
         }
-        i++;
     }
 
-    printf("Unknown command: %s\n", command);
+    struct cmds *c = cmd_by_name(command);
+    if (c == NULL) {
+        out_printf("Unknown command: %s\n", command);
+        if (cur_client) {
+            cur_client->errors++;
+        }
+        return;
+    }
+
+    char *args[MAX_ARGS];
+    int num_args = 0;
+    char *arg = strtok(NULL, " \t\r\n");
+
+    while (arg != NULL && num_args < MAX_ARGS) {
+        args[num_args++] = arg;
+        arg = strtok(NULL, " \t\r\n");
+    }
+
+    // a trailing 'force' makes the command go to the board, cache or not
+    int force = (num_args > 0 && strcasecmp(args[num_args - 1], "force") == 0);
+    if (force) {
+        num_args--;
+    }
+
+    // chan N in front of another command selects the channel for it
+    if (c->func == c_chan && num_args >= 2 && cmd_by_name(args[1]) != NULL) {
+        c_chan(fd, args, 1);
+        c = cmd_by_name(args[1]);
+        num_args -= 2;
+        memmove(args, args + 2, num_args * sizeof(args[0]));
+    }
+
+    if (num_args < c->min_args || num_args > c->max_args) {
+        out_printf("Usage: %s %s\n", c->name, c->msg);
+        if (cur_client) {
+            cur_client->errors++;
+        }
+    } else {
+        force_query = force;
+        c->func(fd, args, num_args);
+        force_query = 0;
+    }
 }
 
-void show_help(int argc, char **argv) {
-    printf("Usage: %s [option] - Control AD9959+stm32 DDS VFO board from ch*na\n", argv[0]);
-    printf("\t-h\t\tThis help message\n");
-    printf("\t-p\t\tSerial port path\n");
-    printf("\t-d\t\tDebug level\n");
+// Run buffered input lines until we run out, hit a sleep or the queue backs up
+void input_run(int fd) {
+    char line[BUFFER_SIZE];
+
+    if (input_busy || quit_msg) {
+       return;
+    }
+
+    input_busy = 1;
+    while (!ev_is_active(&sleep_timer) && boards_backlog() < CMDQ_SIZE / 2 && !quit_msg && !boards_probing()) {
+       // commands go to the selected board unless they say otherwise
+       brd = sel_board;
+       fd = brd->fd;
+
+       // a running script goes before anything typed after it (and waits for a replay)
+       if (replay.board == NULL && script_step(fd)) {
+          continue;
+       }
+       if (replay_holds(&stdin_rx) || ring_getline(&stdin_rx, line, sizeof(line)) < 0) {
+          break;
+       }
+       handle_command(fd, line);
+    }
+    input_busy = 0;
+
+    if (quit_msg) {
+       return;
+    } else if (input_eof) {
+       // out of input, once everything's done we're done (unless we're serving clients)
+       if (stdin_rx.head == stdin_rx.tail && !ev_is_active(&sleep_timer) && !script_running && !daemon_mode()) {
+          c_quit(fd, NULL, 0);
+       }
+    } else if (!ev_is_active(&stdin_watcher) && (stdin_rx.head - stdin_rx.tail) <= RING_SIZE / 2) {
+       // not until there's room for a decent read, rather than a line at a time
+       ev_io_start(loop, &stdin_watcher);
+    }
 }
 
-void load_script(const char *path) {
-    // check if file exists
-    // open file
-    FILE *fp = fopen(path, "r");
-    char line[512];
+// A line from readline (NULL at EOF), into the same ring piped input goes to
+static void stdin_line_cb(char *text) {
+    if (text == NULL) {
+       input_eof = 1;
+       ev_io_stop(loop, &stdin_watcher);
+       rl_callback_handler_remove();
+       return;
+    }
+    size_t len = strlen(text);
+    if (len >= BUFFER_SIZE) {
+       out_printf("*** Line too long (%zu bytes), ignored\n", len);
+       free(text);
+       return;
+    }
+    if (len > 0) {
+       add_history(text);
+    }
+    for (size_t i = 0; i <= len; i++) {
+       stdin_rx.data[stdin_rx.head++ & (RING_SIZE - 1)] = (i < len ? text[i] : '\n');
+    }
+    stdin_rx.bytes += len + 1;
+    stdin_rx.reads++;
+    free(text);
+}
 
-    if (fp == NULL) {
-       int my_errno = errno;
+void input_tty_done(void) {
+    if (input_tty && !input_eof) {
+       rl_callback_handler_remove();
+    }
+}
 
-       printf("Error opening script %s: %d (%s)", path, my_errno, strerror(my_errno));
+static void stdin_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    if (input_tty) {
+       rl_callback_read_char();
+       // stop short of full, so a whole line always fits
+       if (!input_eof && RING_SIZE - (stdin_rx.head - stdin_rx.tail) <= BUFFER_SIZE) {
+          ev_io_stop(loop, w);
+       }
+       input_run(sel_board->fd);
+       return;
     }
 
-    // read file & loop over it
-    while (fgets(line, sizeof(line), fp) != NULL) {
-       // clean line endings...
-       if (line[strlen(line) - 1] == '\n' || line[strlen(line) - 1] == '\r') {
-          line[strlen(line) - 1] = '\0';
+    ssize_t nbytes = ring_fill(&stdin_rx, w->fd);
+
+    if (nbytes <= 0 && (nbytes == 0 || (errno != EAGAIN && errno != EINTR))) {
+       // terminate any partial last line so it still gets run
+       if (stdin_rx.head != stdin_rx.tail && (stdin_rx.head - stdin_rx.tail) < RING_SIZE) {
+          stdin_rx.data[stdin_rx.head++ & (RING_SIZE - 1)] = '\n';
+       }
+       input_eof = 1;
+       ev_io_stop(loop, w);
+    } else if ((stdin_rx.head - stdin_rx.tail) >= RING_SIZE) {
+       // full, stop reading until some of it's been run
+       ev_io_stop(loop, w);
+    }
+    input_run(sel_board->fd);
+}
+
+static void serial_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    brd = w->data;
+    serial_read_cb(w->fd);
+}
+
+static void cmdq_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    brd = w->data;
+    cmdq_check_timeouts(brd->fd);
+}
+
+static void sleep_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    input_run(sel_board->fd);
+}
+
+static void tx_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+    boards_flush();
+    if (json_out) {
+       fflush(json_out);
+    }
+}
+
+static void input_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+    if (clients) {
+       clients_prepare();
+    }
+    if (quit_msg && boards_idle()) {
+       quit_now();
+    }
+    if (stdin_rx.head != stdin_rx.tail || input_eof || script_running) {
+       input_run(sel_board->fd);
+    }
+}
+
+// Lock, open and set up a board's serial port, then start watching it
+void board_open(struct board *b, char *port) {
+    char lockfile_path[PATH_MAX];
+    port_file(port, ".lock", lockfile_path, sizeof(lockfile_path));
+
+    // Open the lockfile for writing, it stays open (and locked) until we exit
+    int lockfile_fd = open(lockfile_path, O_WRONLY | O_CREAT, 0644);
+    if (lockfile_fd == -1) {
+        perror("Failed to open lockfile");
+        exit(EXIT_FAILURE);
+    }
+
+    // Try to acquire an exclusive lock on the lockfile
+    if (flock(lockfile_fd, LOCK_EX | LOCK_NB) == -1) {
+        // Failed to acquire lock (another process, or an earlier -p, holds the lock)
+        fprintf(stderr, "Another process is already using %s\n", port);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(b, 0, sizeof(*b));
+    b->port = port;
+    b->fd = open_serial_port(port);
+    configure_serial_port(b->fd);
+    b->cmdq.window = cmdq_window;
+    b->cmdq.timeout = CMD_TIMEOUT;
+    b->ref_clk = 25000000;
+    b->clk_mult = 1;
+    b->curr_chan = 1;
+    num_boards++;
+    pace_load(b);
+
+    ev_io_init(&b->watcher, serial_cb, b->fd, EV_READ);
+    b->watcher.data = b;
+    ev_io_start(loop, &b->watcher);
+    ev_timer_init(&b->cmdq_timer, cmdq_timer_cb, 0., 0.);
+    b->cmdq_timer.data = b;
+
+    if (!exec_mode) {
+        out_printf("Serial port %s connected on fd %d as board%d\n", port, b->fd, num_boards);
+    }
+}
+
+// Add -x's ;-separated commands to s, checking them as a script would be.
+// Returns how many were bad.
+int exec_compile(struct script *s, const char *arg, char **text, size_t *text_len) {
+    char *copy = strdup(arg), *save = NULL, *cmd;
+    int errors = 0;
+
+    if (copy == NULL) {
+       abort();
+    }
+    for (cmd = strtok_r(copy, ";", &save); cmd != NULL; cmd = strtok_r(NULL, ";", &save)) {
+       char line[BUFFER_SIZE], err[128];
+       size_t len;
+
+       while (isspace((unsigned char)*cmd)) {
+          cmd++;
        }
-       if (line[strlen(line) - 1] == '\n' || line[strlen(line) - 1] == '\r') {
-          line[strlen(line) - 1] = '\0';
+       if (*cmd == '\0') {
+          continue;
        }
 
-       // Remove trailing whitespace
-       int len = strlen(line);
-       while (len > 0 && isspace(line[len - 1])) {
-           line[len - 1] = '\0';
-           len--;
+       // keep the text as given, for handing to a daemon
+       len = strlen(cmd);
+       if ((*text = realloc(*text, *text_len + len + 2)) == NULL) {
+          abort();
        }
+       memcpy(*text + *text_len, cmd, len);
+       (*text)[*text_len + len] = '\n';
+       *text_len += len + 1;
+       (*text)[*text_len] = '\0';
 
-       // Skip leading whitespace
-       char *cmd_start = line;
-       while (isspace(*cmd_start)) {
-           cmd_start++;
+       snprintf(line, sizeof(line), "%s", cmd);
+       if (script_compile_line(s, line, s->nops + 1, err, sizeof(err)) < 0) {
+          fprintf(stderr, "-x %s: %s\n", cmd, err);
+          errors++;
        }
+    }
+    free(copy);
+    return errors;
+}
 
-       // skip single-line comments (we don't support multi-line)
-       if (cmd_start[0] == '#' || cmd_start[0] == ';' || (cmd_start[0] == '/' && cmd_start[1] == '/')) {
-          continue;
+// -x with -D: pass the commands to the daemon there instead of opening the
+// port ourselves. Returns if there's no daemon, otherwise exits 1 if any
+// of it failed.
+void exec_via_daemon(const char *path, const char *text) {
+    struct sockaddr_un sa;
+    char line[BUFFER_SIZE];
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    FILE *fp;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+       if (fd >= 0) {
+          close(fd);
        }
+       return;
     }
 
-    // close file
-    fclose(fp);
+    if (write(fd, text, strlen(text)) != (ssize_t)strlen(text) || (fp = fdopen(fd, "r")) == NULL) {
+       perror("Error writing to daemon");
+       exit(EXIT_FAILURE);
+    }
+    // the daemon hangs up once it's answered everything
+    shutdown(fd, SHUT_WR);
+
+    // everything up to the daemon's status line is ours to pass on
+    while (fgets(line, sizeof(line), fp) != NULL) {
+       int errors, timeouts;
+
+       if (strncmp(line, CLIENT_DONE " ", sizeof(CLIENT_DONE)) == 0 &&
+           sscanf(line + sizeof(CLIENT_DONE), "%d errors, %d timeouts", &errors, &timeouts) == 2) {
+          exit(errors || timeouts);
+       }
+       fputs(line, stdout);
+    }
+    fprintf(stderr, "The daemon hung up without saying how it went\n");
+    exit(EXIT_FAILURE);
+}
+
+void show_help(int argc, char **argv) {
+    out_printf("Usage: %s [option] - Control AD9959+stm32 DDS VFO board from ch*na\n", argv[0]);
+    out_printf("\t-h\t\tThis help message\n");
+    out_printf("\t-p\t\tSerial port path (repeat for more boards)\n");
+    out_printf("\t-d\t\tDebug level\n");
+    out_printf("\t-w\t\tMax commands in flight (default %d)\n", CMDQ_WINDOW);
+    out_printf("\t-l\t\tRun script once connected\n");
+    out_printf("\t-x\t\tRun these commands (; separated) and exit, via the -D daemon if there is one\n");
+    out_printf("\t-D\t\tDaemon: take commands from clients on this unix socket\n");
+    out_printf("\t-T\t\tDaemon: also take them on this localhost tcp port\n");
+    out_printf("\t-J\t\tJSON lines on stdout, the usual text goes to stderr\n");
+    out_printf("\t-q\t\tNo text output (only -J's, if given)\n");
 }
 
 int main(int argc, char **argv) {
     int opt;
+    struct script *startup_script = NULL;
+    char *ports[MAX_BOARDS];
+    int num_ports = 0;
+    struct script *exec_script = NULL;
+    int json_mode = 0, quiet = 0;
+    char *exec_text = NULL;
+    size_t exec_text_len = 0;
+    int exec_errors = 0;
+
+    // nothing's said before this, and until a client comes along it's to the console
+    msg_out = cons_out = stdout;
+
+    // before -l, scripts are checked against the command table
+    dispatch_init();
 
     struct option long_options[] = {
         {"port", required_argument, NULL, 'p'},
         {"debug", optional_argument, NULL, 'd'},
         {"help", no_argument, NULL, 'h'},
-        {"load", no_argument, NULL, 'l'},
+        {"load", required_argument, NULL, 'l'},
         {"save", no_argument, NULL, 's'},
-        {"exec", no_argument, NULL, 'x'},
+        {"exec", required_argument, NULL, 'x'},
+        {"window", required_argument, NULL, 'w'},
+        {"daemon", required_argument, NULL, 'D'},
+        {"tcp", required_argument, NULL, 'T'},
+        {"json", no_argument, NULL, 'J'},
+        {"quiet", no_argument, NULL, 'q'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "p:d::hl:sx", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:d::hl:sx:w:D:T:Jq", long_options, NULL)) != -1) {
         switch (opt) {
             case 'p':
-                serial_port = optarg;
+                if (num_ports >= MAX_BOARDS) {
+                    fprintf(stderr, "Too many ports, at most %d boards\n", MAX_BOARDS);
+                    exit(EXIT_FAILURE);
+                }
+                ports[num_ports++] = optarg;
                 break;
             case 'd':
                 if (optarg != NULL) {
@@ -816,17 +6417,45 @@ int main(int argc, char **argv) {
                 show_help(argc, argv);
                 exit(EXIT_SUCCESS);
             case 'l':
-                load_script(optarg);
+                // check it over before we touch the board
+                if ((startup_script = script_load(optarg)) == NULL) {
+                    exit(EXIT_FAILURE);
+                }
                 break;
             case 's':
                 save_config(optarg);
                 exit(EXIT_SUCCESS);
                 break;
+            case 'w':
+                cmdq_window = atoi(optarg);
+                cmdq_window_set = 1;
+                if (cmdq_window < 1 || cmdq_window > 64) {
+                    fprintf(stderr, "Invalid window %s [1-64]\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                daemon_path = optarg;
+                break;
+            case 'J':
+                json_mode = 1;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'T':
+                daemon_tcp = atoi(optarg);
+                if (daemon_tcp < 1 || daemon_tcp > 65535) {
+                    fprintf(stderr, "Invalid tcp port %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'x':
-                // Call c_exec function
-                printf("Calling c_exec function\n");
-                // exec_cmd(argc, argv);
-                exit(0);
+                if (exec_script == NULL && (exec_script = calloc(1, sizeof(struct script))) == NULL) {
+                    abort();
+                }
+                exec_script->path = "-x";
+                exec_errors += exec_compile(exec_script, optarg, &exec_text, &exec_text_len);
                 break;
             default:
                 // Invalid option
@@ -835,73 +6464,126 @@ int main(int argc, char **argv) {
         }
     }
 
-    char *lockfile_name;
+    if (num_ports == 0) {
+        ports[num_ports++] = DEFAULT_PORT;
+    }
 
-    // Find the position of the last '/' in the serial_port string
-    char *last_slash_position = strrchr(serial_port, '/');
-    if (last_slash_position != NULL) {
-        // Get the substring after the last '/'
-        lockfile_name = last_slash_position + 1;
-    } else {
-        // If no '/' found, use the whole serial_port string
-        lockfile_name = serial_port;
+    // -J takes stdout over, what we'd have printed goes to stderr (or with -q, nowhere)
+    if (json_mode || quiet) {
+        int text_fd = (quiet ? open("/dev/null", O_WRONLY) : dup(STDERR_FILENO));
+
+        if (json_mode && (json_out = fdopen(dup(STDOUT_FILENO), "w")) != NULL) {
+            setvbuf(json_out, NULL, _IOFBF, JSON_BUF);
+        }
+        if (text_fd < 0 || dup2(text_fd, STDOUT_FILENO) < 0 || (json_mode && json_out == NULL)) {
+            perror("Failed to set up output");
+            exit(EXIT_FAILURE);
+        }
+        close(text_fd);
     }
 
-    // Append ".lock" to the lockfile name
-    char lockfile_path[PATH_MAX];
-    snprintf(lockfile_path, PATH_MAX, "%s.lock", lockfile_name);
+    if (exec_script) {
+        if (exec_errors) {
+            exit(2);
+        } else if (startup_script) {
+            fprintf(stderr, "-x and -l can't be used together\n");
+            exit(EXIT_FAILURE);
+        }
+        // a daemon that's already got the port is quicker than opening it
+        if (daemon_path) {
+            exec_via_daemon(daemon_path, exec_text);
+        }
+        daemon_path = NULL;
+        daemon_tcp = 0;
 
-    // Open the lockfile for writing
-    int lockfile_fd = open(lockfile_path, O_WRONLY | O_CREAT, 0644);
-    if (lockfile_fd == -1) {
-        perror("Failed to open lockfile");
-        exit(EXIT_FAILURE);
+        // just the commands and their own replies, no readbacks
+        script_batch(exec_script);
+        exec_mode = 1;
+        refresh_policy = REFRESH_NEVER;
+        startup_script = exec_script;
     }
 
-    // Try to acquire an exclusive lock on the lockfile
-    if (flock(lockfile_fd, LOCK_EX | LOCK_NB) == -1) {
-        // Failed to acquire lock (another process holds the lock)
-        fprintf(stderr, "Another process is already using %s\n", serial_port);
-        exit(EXIT_FAILURE);
+    if (!exec_mode) {
+        out_printf("Chineze ad9959 DDS board control widget v%s starting (debug: %d)!\n", VERSION, debug);
     }
 
-    // zero out channel state storage
-    memset(chan_state, 0, sizeof(struct ChannelState) * MAX_CHAN);
+    // set up the event loop
+    loop = EV_DEFAULT;
+    for (int i = 0; i < num_ports; i++) {
+        board_open(&boards[i], ports[i]);
+    }
+    ev_io_init(&stdin_watcher, stdin_cb, STDIN_FILENO, EV_READ);
+    if (exec_mode) {
+        // we're done when the commands are
+        input_eof = 1;
+    } else {
+        out_printf("Type 'help' for commands or press Ctrl+C to exit.\n");
+        // a person gets line editing and history, anything else is read in bulk
+        if (isatty(STDIN_FILENO)) {
+           input_tty = 1;
+           rl_callback_handler_install("", stdin_line_cb);
+           atexit(input_tty_done);
+        }
+        ev_io_start(loop, &stdin_watcher);
+    }
+    ev_timer_init(&sleep_timer, sleep_timer_cb, 0., 0.);
+    ev_timer_init(&hop_timer, hop_timer_cb, 0., 0.);
+    ev_timer_init(&hsweep_timer, hsweep_timer_cb, 0., 0.);
+    ev_timer_init(&replay_timer, replay_timer_cb, 0., 0.);
+    // keying edges come first, before anything else that's ready
+    if ((key.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+       out_printf("*** timerfd_create: %s, no keying\n", strerror(errno));
+    }
+    ev_io_init(&key_watcher, key_timer_cb, key.tfd, EV_READ);
+    ev_set_priority(&key_watcher, EV_MAXPRI);
+    ev_signal_init(&trace_signal, trace_signal_cb, SIGUSR1);
+    ev_signal_start(loop, &trace_signal);
+    ev_signal_init(&quit_signals[0], quit_signal_cb, SIGINT);
+    ev_signal_start(loop, &quit_signals[0]);
+    ev_signal_init(&quit_signals[1], quit_signal_cb, SIGTERM);
+    ev_signal_start(loop, &quit_signals[1]);
+    ev_prepare_init(&input_prepare, input_prepare_cb);
+    ev_prepare_start(loop, &input_prepare);
+    // lower priority than input, so it goes after anything input queues up
+    ev_prepare_init(&tx_prepare, tx_prepare_cb);
+    ev_set_priority(&tx_prepare, EV_MINPRI);
+    ev_prepare_start(loop, &tx_prepare);
 
-    // setup the serial port
-    int serial_fd = open_serial_port(serial_port);
-    configure_serial_port(serial_fd);
+    // probe the boards. -x only needs to know which channel is selected,
+    // and not even that if it starts by selecting one.
+    for (int i = 0; i < num_boards; i++) {
+        brd = &boards[i];
+        if (!exec_mode) {
+            // a couple of round trips to check the snapshot instead of reading it all, if there is one
+            if (snapshot_load(brd)) {
+                snapshot_probe(brd->fd);
+            } else {
+                c_info(brd->fd, NULL, 0);
+            }
+            continue;
+        }
+        // -x adds what it learns to the snapshot, sight unseen
+        snapshot_load(brd);
+        if (exec_script->nops > 0 && !(exec_script->ops[0].op == OP_SET && exec_script->ops[0].field == F_CHAN)) {
+            c_chan(brd->fd, NULL, 0);
+            script_hold = 1;
+        }
+    }
+    brd = sel_board;
 
-    printf("Chineze ad9959 DDS board control widget v%s starting (debug: %d)!\n", VERSION, debug);
-    printf("Serial port %s connected on fd %d. Type 'help' for commands or press Ctrl+C to exit.\n", serial_port, serial_fd);
+    if (daemon_path || daemon_tcp) {
+        daemon_start();
+    }
 
-    // probe the board
-    c_info(serial_fd, NULL, 0);
+    if (startup_script) {
+       script_start(startup_script);
+    }
 
     // main io loop
-    fd_set rfds;
-    struct timeval tv;
-    while (1) {
-        FD_ZERO(&rfds);
-        FD_SET(STDIN_FILENO, &rfds);
-        FD_SET(serial_fd, &rfds);
-
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000; // 10ms
-
-        if (select(serial_fd + 1, &rfds, NULL, NULL, &tv) > 0) {
-            if (FD_ISSET(STDIN_FILENO, &rfds)) {
-                char buf[BUFFER_SIZE];
-                if (fgets(buf, sizeof(buf), stdin) != NULL) {
-                    handle_command(serial_fd, buf);
-                }
-            }
-            if (FD_ISSET(serial_fd, &rfds)) {
-                serial_read_cb(serial_fd);
-            }
-        }
-    }
+    ev_run(loop, 0);
 
-    close(serial_fd);
+    for (int i = 0; i < num_boards; i++) {
+        close(boards[i].fd);
+    }
     return 0;
 }
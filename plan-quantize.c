@@ -0,0 +1,39 @@
+/*
+ * The inner loop of freqgen's plan generator, on its own so it can be built
+ * at -O3 -fno-trapping-math whatever freqgen itself is built with: gcc only
+ * vectorizes at -O3 (or -O2 from gcc 12), only turns the compares in here
+ * into selects if they can't trap, and optimize attributes don't get it there.
+ *
+ * It works on separate arrays rather than freqgen's plan_points, and
+ * rounds with PLAN_RINT rather than round()/floor(), which are calls, or
+ * need SSE4.1 to vectorize. Built as below, gcc -fopt-info-vec reports the loop
+ * vectorized on plain x86-64.
+ *
+ * Build as such:
+ *	cc -ggdb -Wall -pedantic -O3 -fno-trapping-math -c plan-quantize.c
+ */
+#include <math.h>
+
+// rint() for 0 <= x < 2^51 without a call: adding 1.5 * 2^52 leaves no
+// bits after the point, so the FPU's round to nearest does the work
+#define	PLAN_RINT(x)	(((x) + 6755399441055744.0) - 6755399441055744.0)
+
+// The whole Hz closest to each of want[] once it's been made into an FTW
+// (Hz * 2^32 / sysclk, taken to be rounded to the nearest), with the FTW
+// and the error
+void plan_quantize(const double *restrict want, double *restrict hz, double *restrict ftw,
+                   double *restrict error, int n, double sysclk) {
+    const double scale = 4294967296.0 / sysclk, step = sysclk / 4294967296.0;
+
+    for (int i = 0; i < n; i++) {
+       double r = PLAN_RINT(want[i]);
+       double lo = r - (r > want[i]);
+       double ftw_lo = PLAN_RINT(lo * scale), ftw_hi = PLAN_RINT((lo + 1) * scale);
+       double up = (fabs(ftw_hi * step - want[i]) < fabs(ftw_lo * step - want[i]));
+
+       // up is 0 or 1, so these are exact
+       hz[i] = lo + up;
+       ftw[i] = ftw_lo + up * (ftw_hi - ftw_lo);
+       error[i] = ftw[i] * step - want[i];
+    }
+}